@@ -0,0 +1,135 @@
+#include <shalloc/shalloc.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * Mapping cost of the guard page policies. Every heap policy creates
+ * GUARD_NUM_HEAPS heaps of GUARD_HEAP_SIZE bytes, and every region policy
+ * grows a region to GUARD_NUM_BUFFS buffers. The benchmark reports the
+ * mmap() and mprotect() calls made and the VMAs added per heap or buffer.
+ * It counts the calls by defining both functions itself, which shalloc.so
+ * then binds to.
+ */
+#define GUARD_NUM_HEAPS             64
+#define GUARD_HEAP_SIZE             (1 << 20)
+#define GUARD_NUM_BUFFS             64
+#define GUARD_BUFF_SIZE             (64 << 10)
+
+static int guard_mmaps;
+static int guard_mprotects;
+
+void* mmap(void *addr, size_t length, int prot, int flags, int fd,
+    off_t offset)
+{
+    guard_mmaps++;
+    return (void*) syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+int mprotect(void *addr, size_t len, int prot)
+{
+    guard_mprotects++;
+    return syscall(SYS_mprotect, addr, len, prot);
+}
+
+static int guard_num_vmas()
+{
+    FILE *file = fopen("/proc/self/maps", "r");
+    int c, num_vmas = 0;
+
+    if (!file) {
+        return -1;
+    }
+    while ((c = fgetc(file)) != EOF) {
+        num_vmas += c == '\n';
+    }
+    fclose(file);
+    return num_vmas;
+}
+
+static void guard_report(const char *name, int num, int mmaps,
+    int mprotects, int vmas)
+{
+    printf("%-14s mmap=%5.2f mprotect=%5.2f vmas=%5.2f\n", name,
+        (double) mmaps/num, (double) mprotects/num, (double) vmas/num);
+}
+
+static int guard_run_heaps(const char *name, int mmap_flags)
+{
+    shalloc_heap_t *heaps[GUARD_NUM_HEAPS];
+    int i, mmaps, mprotects, vmas;
+
+    mmaps = guard_mmaps;
+    mprotects = guard_mprotects;
+    vmas = guard_num_vmas();
+    for (i = 0; i < GUARD_NUM_HEAPS; i++) {
+        heaps[i] = shalloc_heap_create(GUARD_HEAP_SIZE, mmap_flags, 0);
+        if (!heaps[i]) {
+            printf("%-14s heap creation failed\n", name);
+            return -1;
+        }
+    }
+    guard_report(name, GUARD_NUM_HEAPS, guard_mmaps - mmaps,
+        guard_mprotects - mprotects, guard_num_vmas() - vmas);
+    for (i = 0; i < GUARD_NUM_HEAPS; i++) {
+        shalloc_region_destroy(shalloc_heap_to_region(heaps[i]));
+    }
+    return 0;
+}
+
+static int guard_run_region(const char *name, shalloc_heap_t *heap,
+    int flags)
+{
+    shalloc_region_info_t info;
+    shalloc_region_t *region;
+    int mmaps, mprotects, vmas;
+
+    mmaps = guard_mmaps;
+    mprotects = guard_mprotects;
+    vmas = guard_num_vmas();
+    region = shalloc_region_create(shalloc_heap_to_region(heap),
+        GUARD_BUFF_SIZE, GUARD_BUFF_SIZE, 0, flags,
+        SHALLOC_BUFF_ALLOC_TYPE_NOFREE);
+    if (!region) {
+        printf("%-14s region creation failed\n", name);
+        return -1;
+    }
+
+    /* Grow the region buffer by buffer. */
+    do {
+        if (!shalloc_malloc(region, GUARD_BUFF_SIZE/2 + 1)) {
+            printf("%-14s allocation failed\n", name);
+            return -1;
+        }
+        shalloc_region_get_info(region, &info);
+    } while (info.num_buffs < GUARD_NUM_BUFFS);
+    guard_report(name, info.num_buffs, guard_mmaps - mmaps,
+        guard_mprotects - mprotects, guard_num_vmas() - vmas);
+    shalloc_region_destroy(region);
+    return 0;
+}
+
+int main()
+{
+    shalloc_heap_t *heap;
+    int ret = 0;
+
+    shalloc_space_init();
+    ret |= guard_run_heaps("heap-default", SHALLOC_DEFAULT_MMAP_FLAGS);
+    ret |= guard_run_heaps("heap-none", SHALLOC_DEFAULT_MMAP_FLAGS
+        |SHALLOC_MAP_GUARD_NONE);
+    ret |= guard_run_heaps("heap-trail", SHALLOC_DEFAULT_MMAP_FLAGS
+        |SHALLOC_MAP_GUARD_TRAIL);
+    ret |= guard_run_heaps("heap-around", SHALLOC_DEFAULT_MMAP_FLAGS
+        |SHALLOC_MAP_GUARD_AROUND);
+
+    heap = shalloc_heap_create(4*GUARD_NUM_BUFFS*GUARD_BUFF_SIZE,
+        SHALLOC_DEFAULT_MMAP_FLAGS, 0);
+    if (!heap) {
+        printf("region heap creation failed\n");
+        return 1;
+    }
+    ret |= guard_run_region("region-none", heap, 0);
+    ret |= guard_run_region("region-guard", heap, SHALLOC_FLAG(GUARD));
+    shalloc_space_close();
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+#include <shalloc/shalloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Cost of creating a large heap. Every mode creates a heap of
+ * CREATE_HEAP_SIZE bytes, only reserved with MAP_NORESERVE, and reports
+ * the time shalloc_heap_create() took and the growth of the max RSS. Each
+ * mode runs in a child of its own, so the max RSS starts out the same.
+ */
+#define CREATE_HEAP_SIZE            (16UL << 30)
+#define CREATE_SPACE_SIZE           (2*CREATE_HEAP_SIZE)
+#define CREATE_SLAB_BLOCK_SIZE      256
+#define CREATE_MMAP_FLAGS           (SHALLOC_DEFAULT_MMAP_FLAGS|MAP_NORESERVE)
+
+static long create_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static long create_maxrss()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int create_run(const char *name, enum shalloc_buff_alloc_type type,
+    size_t block_size)
+{
+    shalloc_heap_t *heap;
+    long start, elapsed, maxrss;
+
+    shalloc_space_init_at(NULL, CREATE_SPACE_SIZE);
+    maxrss = create_maxrss();
+    start = create_now();
+    heap = block_size ? shalloc_heap_create_with_block_size(CREATE_HEAP_SIZE,
+        block_size, CREATE_MMAP_FLAGS, type) :
+        shalloc_heap_create(CREATE_HEAP_SIZE, CREATE_MMAP_FLAGS, type);
+    elapsed = create_now() - start;
+    if (!heap) {
+        printf("%-10s heap creation failed\n", name);
+        return -1;
+    }
+    printf("%-10s %9.1fus maxrss+=%ldKB\n", name, elapsed/1000.0,
+        create_maxrss() - maxrss);
+    shalloc_region_destroy(shalloc_heap_to_region(heap));
+    shalloc_space_close();
+    return 0;
+}
+
+static int create_fork(const char *name, enum shalloc_buff_alloc_type type,
+    size_t block_size)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        status = create_run(name, type, block_size);
+        fflush(stdout);
+        _exit(status ? 1 : 0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int ret = 0;
+
+    ret |= create_fork("mplite", SHALLOC_BUFF_ALLOC_TYPE_MPLITE, 0);
+    ret |= create_fork("slab", SHALLOC_BUFF_ALLOC_TYPE_SLAB,
+        CREATE_SLAB_BLOCK_SIZE);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+#include <shalloc/shalloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * dTLB misses of random reads from heaps of small pages, transparent huge
+ * pages (SHALLOC_MAP_HUGEPAGE) and hugetlbfs pages (MAP_HUGETLB). Every
+ * mode allocates HUGEPAGE_BUFF_SIZE bytes from a fresh heap, touches them
+ * and times HUGEPAGE_NUM_READS dependent reads at random offsets. Misses
+ * are counted with perf events where the kernel allows it, and hugetlbfs
+ * heaps need huge pages reserved in /proc/sys/vm/nr_hugepages.
+ */
+#define HUGEPAGE_HEAP_SIZE          (512UL << 20)
+#define HUGEPAGE_BUFF_SIZE          (256UL << 20)
+#define HUGEPAGE_NUM_READS          (16 << 20)
+
+static volatile size_t hugepage_sink;
+
+static long hugepage_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static int hugepage_open_misses()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int hugepage_run(const char *name, int mmap_flags)
+{
+    shalloc_heap_t *heap;
+    size_t *buff, i, j, tmp, num_words = HUGEPAGE_BUFF_SIZE/sizeof(size_t);
+    long long misses = -1;
+    long start, elapsed;
+    int fd;
+
+    heap = shalloc_heap_create(HUGEPAGE_HEAP_SIZE, mmap_flags, 0);
+    buff = heap ? shalloc_malloc(shalloc_heap_to_region(heap),
+        HUGEPAGE_BUFF_SIZE) : NULL;
+    if (!buff) {
+        printf("%-10s unavailable\n", name);
+        if (heap) {
+            shalloc_region_destroy(shalloc_heap_to_region(heap));
+        }
+        return 0;
+    }
+
+    /* A random cycle through the buffer, so reads depend on each other. */
+    srand(1);
+    for (i = 0; i < num_words; i++) {
+        buff[i] = i;
+    }
+    for (i = num_words - 1; i > 0; i--) {
+        j = ((size_t) rand() << 16 ^ rand()) % i;
+        tmp = buff[i];
+        buff[i] = buff[j];
+        buff[j] = tmp;
+    }
+
+    fd = hugepage_open_misses();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = hugepage_now();
+    for (i = 0, j = 0; i < HUGEPAGE_NUM_READS; i++) {
+        j = buff[j];
+    }
+    elapsed = hugepage_now() - start;
+    hugepage_sink = j;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+        close(fd);
+    }
+
+    if (misses < 0) {
+        printf("%-10s %6.1fns/read dtlb-misses=n/a\n", name,
+            (double) elapsed/HUGEPAGE_NUM_READS);
+    }
+    else {
+        printf("%-10s %6.1fns/read dtlb-misses=%5.3f/read\n", name,
+            (double) elapsed/HUGEPAGE_NUM_READS,
+            (double) misses/HUGEPAGE_NUM_READS);
+    }
+    shalloc_region_destroy(shalloc_heap_to_region(heap));
+    return 0;
+}
+
+int main()
+{
+    int ret = 0;
+
+    shalloc_space_init();
+    ret |= hugepage_run("small", SHALLOC_DEFAULT_MMAP_FLAGS);
+    ret |= hugepage_run("thp", SHALLOC_DEFAULT_MMAP_FLAGS
+        |SHALLOC_MAP_HUGEPAGE);
+    ret |= hugepage_run("hugetlb", SHALLOC_DEFAULT_MMAP_FLAGS|MAP_HUGETLB);
+    shalloc_space_close();
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+#include <mplite/mplite.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * Operation costs of mplite on its own, outside any heap. The pingpong mode
+ * times MPLITE_NUM_PAIRS mallocs and frees of MPLITE_PINGPONG_BLOCKS blocks
+ * of MPLITE_PINGPONG_SIZE bytes, allocated and freed in rounds. The random
+ * mode keeps MPLITE_LIVE_BLOCKS blocks of random sizes live in a pool of
+ * MPLITE_POOL_SIZE bytes and times MPLITE_NUM_PAIRS frees of a random live
+ * block, each followed by a malloc of a new random size. The large mode
+ * makes allocations of several GB from a MPLITE_LARGE_POOL_SIZE pool, only
+ * reserved, and reports which succeed.
+ */
+#define MPLITE_POOL_SIZE            (256UL << 20)
+#define MPLITE_MIN_ALLOC            16
+#define MPLITE_LIVE_BLOCKS          50000
+#define MPLITE_MAX_BLOCK_SIZE       1024
+#define MPLITE_NUM_PAIRS            2000000
+#define MPLITE_PINGPONG_BLOCKS      16
+#define MPLITE_PINGPONG_SIZE        200
+#define MPLITE_LARGE_POOL_SIZE      (24UL << 30)
+#define MPLITE_GB                   (1UL << 30)
+
+static void *mplite_blocks[MPLITE_LIVE_BLOCKS];
+
+static long mplite_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static void* mplite_bench_init(mplite_t *handle, size_t size,
+    size_t min_alloc)
+{
+    void *buf;
+
+    buf = mmap(NULL, size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (buf == MAP_FAILED) {
+        buf = NULL;
+    }
+    else if (mplite_init(handle, buf, size, min_alloc, NULL)
+        != MPLITE_OK) {
+        munmap(buf, size);
+        buf = NULL;
+    }
+    if (!buf) {
+        printf("pool of %zu bytes unavailable\n", size);
+    }
+    return buf;
+}
+
+static int mplite_bench_pingpong(mplite_t *handle)
+{
+    long start;
+    int i, k;
+
+    start = mplite_now();
+    for (i = 0; i < MPLITE_NUM_PAIRS; i += MPLITE_PINGPONG_BLOCKS) {
+        for (k = 0; k < MPLITE_PINGPONG_BLOCKS; k++) {
+            mplite_blocks[k] = mplite_malloc(handle, MPLITE_PINGPONG_SIZE);
+            if (!mplite_blocks[k]) {
+                printf("pingpong allocation failed\n");
+                return -1;
+            }
+        }
+        for (k = 0; k < MPLITE_PINGPONG_BLOCKS; k++) {
+            mplite_free(handle, mplite_blocks[k]);
+        }
+    }
+    printf("%-10s %6.1fns/pair\n", "pingpong",
+        (double) (mplite_now() - start)/MPLITE_NUM_PAIRS);
+    return 0;
+}
+
+static int mplite_bench_random(mplite_t *handle)
+{
+    long start;
+    int i, k;
+
+    srand(1);
+    for (i = 0; i < MPLITE_LIVE_BLOCKS; i++) {
+        mplite_blocks[i] = mplite_malloc(handle,
+            1 + rand() % MPLITE_MAX_BLOCK_SIZE);
+        if (!mplite_blocks[i]) {
+            printf("random allocation failed\n");
+            return -1;
+        }
+    }
+    start = mplite_now();
+    for (i = 0; i < MPLITE_NUM_PAIRS; i++) {
+        k = rand() % MPLITE_LIVE_BLOCKS;
+        mplite_free(handle, mplite_blocks[k]);
+        mplite_blocks[k] = mplite_malloc(handle,
+            1 + rand() % MPLITE_MAX_BLOCK_SIZE);
+        if (!mplite_blocks[k]) {
+            printf("random allocation failed\n");
+            return -1;
+        }
+    }
+    printf("%-10s %6.1fns/pair\n", "random",
+        (double) (mplite_now() - start)/MPLITE_NUM_PAIRS);
+    for (i = 0; i < MPLITE_LIVE_BLOCKS; i++) {
+        mplite_free(handle, mplite_blocks[i]);
+    }
+    return 0;
+}
+
+static void* mplite_bench_large_malloc(mplite_t *handle, size_t size)
+{
+    void *ptr = mplite_malloc(handle, size);
+
+    printf("%-10s %2zuGB %s\n", "large", size/MPLITE_GB,
+        ptr ? "ok" : "failed");
+    return ptr;
+}
+
+static int mplite_bench_large()
+{
+    mplite_t handle;
+    void *buf, *a, *b, *c;
+
+    /* Page sized blocks keep the control bytes small. */
+    buf = mplite_bench_init(&handle, MPLITE_LARGE_POOL_SIZE, 4096);
+    if (!buf) {
+        return -1;
+    }
+    a = mplite_bench_large_malloc(&handle, 5*MPLITE_GB);
+    b = mplite_bench_large_malloc(&handle, 8*MPLITE_GB);
+    mplite_free(&handle, a);
+    mplite_free(&handle, b);
+    c = mplite_bench_large_malloc(&handle, 16*MPLITE_GB);
+    munmap(buf, MPLITE_LARGE_POOL_SIZE);
+    return a && b && c ? 0 : -1;
+}
+
+int main()
+{
+    mplite_t handle;
+    void *buf;
+    int ret;
+
+    buf = mplite_bench_init(&handle, MPLITE_POOL_SIZE, MPLITE_MIN_ALLOC);
+    if (!buf) {
+        return 1;
+    }
+    ret = mplite_bench_pingpong(&handle);
+    ret |= mplite_bench_random(&handle);
+    munmap(buf, MPLITE_POOL_SIZE);
+    ret |= mplite_bench_large();
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,134 @@
+#include <shalloc/shalloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * NUMA placement of heaps. Every mode allocates NUMA_BUFF_SIZE bytes from
+ * a heap left to first touch, bound to each online node, interleaved, or
+ * picked with shalloc_numa_heaps_local(). It then reports where
+ * NUMA_SAMPLE_PAGES of its pages landed and the latency of dependent
+ * random reads from the node the benchmark runs on. Pin the benchmark
+ * (e.g. with taskset) to compare local and remote nodes.
+ */
+#define NUMA_HEAP_SIZE              (128 << 20)
+#define NUMA_BUFF_SIZE              (64 << 20)
+#define NUMA_NUM_READS              (8 << 20)
+#define NUMA_SAMPLE_PAGES           1024
+
+static volatile size_t numa_sink;
+
+static long numa_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static int numa_local_pct(char *buff, int node)
+{
+    void *pages[NUMA_SAMPLE_PAGES];
+    int status[NUMA_SAMPLE_PAGES];
+    int i, local = 0;
+
+    /* move_pages() without target nodes only reports where pages are. */
+    for (i = 0; i < NUMA_SAMPLE_PAGES; i++) {
+        pages[i] = buff + (size_t) i*(NUMA_BUFF_SIZE/NUMA_SAMPLE_PAGES);
+    }
+    if (syscall(SYS_move_pages, 0, NUMA_SAMPLE_PAGES, pages, NULL, status,
+        0) < 0) {
+        return -1;
+    }
+    for (i = 0; i < NUMA_SAMPLE_PAGES; i++) {
+        local += status[i] == node;
+    }
+    return local*100/NUMA_SAMPLE_PAGES;
+}
+
+static int numa_run(const char *name, shalloc_heap_t *heap)
+{
+    size_t *buff, i, j, tmp, num_words = NUMA_BUFF_SIZE/sizeof(size_t);
+    int node = shalloc_numa_node(), local_pct;
+    long start, elapsed;
+
+    buff = heap ? shalloc_malloc(shalloc_heap_to_region(heap),
+        NUMA_BUFF_SIZE) : NULL;
+    if (!buff) {
+        printf("%-12s allocation failed\n", name);
+        return -1;
+    }
+
+    /* A random cycle through the buffer, so reads depend on each other. */
+    srand(1);
+    for (i = 0; i < num_words; i++) {
+        buff[i] = i;
+    }
+    for (i = num_words - 1; i > 0; i--) {
+        j = ((size_t) rand() << 16 ^ rand()) % i;
+        tmp = buff[i];
+        buff[i] = buff[j];
+        buff[j] = tmp;
+    }
+    local_pct = numa_local_pct((char*) buff, node);
+
+    start = numa_now();
+    for (i = 0, j = 0; i < NUMA_NUM_READS; i++) {
+        j = buff[j];
+    }
+    elapsed = numa_now() - start;
+    numa_sink = j;
+
+    if (local_pct < 0) {
+        printf("%-12s %6.1fns/read local-pages=n/a\n", name,
+            (double) elapsed/NUMA_NUM_READS);
+    }
+    else {
+        printf("%-12s %6.1fns/read local-pages=%3d%%\n", name,
+            (double) elapsed/NUMA_NUM_READS, local_pct);
+    }
+    shalloc_free(shalloc_heap_to_region(heap), buff);
+    return 0;
+}
+
+static int numa_run_on(const char *name, int node)
+{
+    shalloc_heap_t *heap;
+    int ret;
+
+    heap = shalloc_heap_create_on_node(NUMA_HEAP_SIZE,
+        SHALLOC_DEFAULT_MMAP_FLAGS, 0, node);
+    ret = numa_run(name, heap);
+    if (heap) {
+        shalloc_region_destroy(shalloc_heap_to_region(heap));
+    }
+    return ret;
+}
+
+int main()
+{
+    shalloc_numa_heaps_t numa_heaps;
+    char name[16];
+    int i, ret = 0;
+
+    shalloc_space_init();
+    printf("running on node %d of %d\n", shalloc_numa_node(),
+        shalloc_numa_num_nodes());
+    ret |= numa_run_on("first-touch", SHALLOC_NUMA_ANY);
+    for (i = 0; i < shalloc_numa_num_nodes(); i++) {
+        snprintf(name, sizeof(name), "node%d", i);
+        ret |= numa_run_on(name, i);
+    }
+    ret |= numa_run_on("interleave", SHALLOC_NUMA_INTERLEAVE);
+    if (shalloc_numa_heaps_create(&numa_heaps, NUMA_HEAP_SIZE,
+        SHALLOC_DEFAULT_MMAP_FLAGS, 0) < 0) {
+        printf("%-12s heap creation failed\n", "local");
+        ret = -1;
+    }
+    else {
+        ret |= numa_run("local", shalloc_numa_heaps_local(&numa_heaps));
+        shalloc_numa_heaps_destroy(&numa_heaps);
+    }
+    shalloc_space_close();
+    return ret ? 1 : 0;
+}
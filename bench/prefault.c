@@ -0,0 +1,81 @@
+#include <shalloc/shalloc.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Allocation latency of heaps with and without prefaulting. Every mode
+ * creates a fresh heap and times PREFAULT_NUM_ALLOCS malloc+memset calls
+ * of PREFAULT_ALLOC_SIZE bytes, so each one touches new pages. Heaps
+ * prefaulted asynchronously get PREFAULT_ASYNC_WAIT_US to populate first.
+ */
+#define PREFAULT_HEAP_SIZE          (256 << 20)
+#define PREFAULT_ALLOC_SIZE         4000
+#define PREFAULT_NUM_ALLOCS         20000
+#define PREFAULT_ASYNC_WAIT_US      200000
+
+static long prefault_lat[PREFAULT_NUM_ALLOCS];
+
+static long prefault_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static int prefault_cmp(const void *a, const void *b)
+{
+    long x = *(const long*) a, y = *(const long*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int prefault_run(const char *name, int mmap_flags, int wait_us)
+{
+    shalloc_heap_t *heap;
+    long start, create;
+    char *ptr;
+    int i;
+
+    start = prefault_now();
+    heap = shalloc_heap_create(PREFAULT_HEAP_SIZE, mmap_flags, 0);
+    create = prefault_now() - start;
+    if (!heap) {
+        printf("%-12s heap creation failed\n", name);
+        return -1;
+    }
+    if (wait_us) {
+        usleep(wait_us);
+    }
+    for (i = 0; i < PREFAULT_NUM_ALLOCS; i++) {
+        start = prefault_now();
+        ptr = shalloc_malloc(shalloc_heap_to_region(heap),
+            PREFAULT_ALLOC_SIZE);
+        if (!ptr) {
+            printf("%-12s allocation failed\n", name);
+            return -1;
+        }
+        memset(ptr, 1, PREFAULT_ALLOC_SIZE);
+        prefault_lat[i] = prefault_now() - start;
+    }
+    qsort(prefault_lat, PREFAULT_NUM_ALLOCS, sizeof(long), prefault_cmp);
+    printf("%-12s create=%8.1fus p50=%6.1fus p99=%6.1fus\n", name,
+        create/1000.0, prefault_lat[PREFAULT_NUM_ALLOCS/2]/1000.0,
+        prefault_lat[PREFAULT_NUM_ALLOCS*99/100]/1000.0);
+    shalloc_region_destroy(shalloc_heap_to_region(heap));
+    return 0;
+}
+
+int main()
+{
+    int ret = 0;
+
+    shalloc_space_init();
+    ret |= prefault_run("none", SHALLOC_DEFAULT_MMAP_FLAGS, 0);
+    ret |= prefault_run("populate", SHALLOC_DEFAULT_MMAP_FLAGS|MAP_POPULATE,
+        0);
+    ret |= prefault_run("async", SHALLOC_DEFAULT_MMAP_FLAGS
+        |SHALLOC_MAP_PREFAULT_ASYNC, PREFAULT_ASYNC_WAIT_US);
+    shalloc_space_close();
+    return ret ? 1 : 0;
+}
@@ -55,3 +55,15 @@ void* nofree_alloc(void *buff, size_t buff_size, size_t size,
     return ptr;
 }
 
+int nofree_repair(void *buff, size_t buff_size)
+{
+    nofree_header_t *header = (nofree_header_t*) buff;
+    if (!header->magic_start || header->magic_start != header->magic_end) {
+        return -1;
+    }
+    /* An interrupted allocation may have left next past the end. */
+    if (header->next > (char*) buff + buff_size || (void*) header->next < buff) {
+        header->next = (char*) buff + buff_size;
+    }
+    return 0;
+}
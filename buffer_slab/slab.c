@@ -18,7 +18,7 @@ static inline unsigned slab_address_to_block(slab_header_t *header,
         return UINT_MAX;
     }
     block/=header->block_size;
-    if (block >= header->num_blocks) {
+    if (block >= header->num_init) {
         return UINT_MAX;
     }
     return block;
@@ -35,7 +35,8 @@ static inline unsigned slab_find_free_block(slab_header_t *header)
     unsigned next_block = header->next_block;
     unsigned i;
     for (i=0;i<header->num_blocks;i++) {
-        if (header->bitmap[next_block] == 0) {
+        if (next_block >= header->num_init ||
+            header->bitmap[next_block] == 0) {
             return next_block;
         }
         next_block = (next_block+1) % header->num_blocks;
@@ -64,7 +65,7 @@ int slab_init(void *buff, size_t buff_size, size_t block_size)
         header->blocks += sizeof(long) -
             ((unsigned long)header->blocks)%sizeof(long);
     }
-    memset(header->bitmap, 0, sizeof(char)*header->num_blocks);
+    header->num_init = 0;
     header->next_block = 0;
     return 0;
 }
@@ -86,6 +87,9 @@ void* slab_alloc(void *buff, size_t size)
         return NULL;
     }
     header->bitmap[b]=1;
+    if (b >= header->num_init) {
+        header->num_init = b+1;
+    }
     header->next_block = (b+1) % header->num_blocks;
     return slab_block_to_address(header, b);
 }
@@ -98,3 +102,20 @@ void slab_free(void *buff, void *ptr)
     assert(header->bitmap[b] == 1 && "Double free!");
     header->bitmap[b]=0;
 }
+
+int slab_repair(void *buff)
+{
+    slab_header_t *header = (slab_header_t*) buff;
+    if (!header->magic_start || header->magic_start != header->magic_end) {
+        return -1;
+    }
+    /* Blocks change state with a single store, only the hint can be off. */
+    if (header->num_init > header->num_blocks) {
+        header->num_init = header->num_blocks;
+    }
+    header->next_block %= header->num_blocks;
+    if (header->next_block > header->num_init) {
+        header->next_block = header->num_init;
+    }
+    return 0;
+}
@@ -16,6 +16,7 @@ int nofree_init(void *buff, size_t buff_size);
 void nofree_close(void *buff, size_t buff_size);
 void* nofree_alloc(void *buff, size_t buff_size, size_t size,
     size_t align);
+int nofree_repair(void *buff, size_t buff_size);
 
 #endif /* BUFFER_NOFREE_H */
 
@@ -7,11 +7,13 @@
 
 /* Simple buffer-based slab allocator.
  * Can only allocate/deallocate blocks of a predetermined size. 
+ * The bitmap is initialized lazily, entries from num_init on are free.
  */
 typedef struct {
     int magic_start;
     size_t block_size;
     size_t num_blocks;
+    size_t num_init;
     char *bitmap;
     char *blocks;
     unsigned next_block;
@@ -22,6 +24,7 @@ int slab_init(void *buff, size_t buff_size, size_t block_size);
 void slab_close(void *buff);
 void* slab_alloc(void *buff, size_t size);
 void slab_free(void *buff, void *ptr);
+int slab_repair(void *buff);
 
 #endif /* BUFFER_SLAB_H */
 
@@ -45,6 +45,7 @@
 #else
 #include <stdint.h>
 #endif /* #ifdef _WIN32 */
+#include <stddef.h>
 
 /**
  * @brief The function call returns success
@@ -54,23 +55,67 @@
  * @brief Invalid parameters are passed to a function
  */
 #define MPLITE_ERR_INVPAR    -1
+/**
+ * @brief The memory pool metadata is corrupt beyond repair
+ */
+#define MPLITE_ERR_CORRUPT   -2
 /**
  * @brief Macro to fix unused parameter compiler warning
  */
 #define MPLITE_UNUSED_PARAM(param)    (void)(param)
 /**
  * @brief Maximum size of any allocation is ((1 << @ref MPLITE_LOGMAX) *
- *        mplite_t.szAtom). Since mplite_t.szAtom is always at least 8 and
- *        32-bit integers are used, it is not actually possible to reach this
- *        limit.
+ *        mplite_t.szAtom), capped by @ref MPLITE_MAX_ALLOC_SIZE. It must fit
+ *        the log2 size bits of a control byte.
  */
-#define MPLITE_LOGMAX 30
+#define MPLITE_LOGMAX 40
 /**
  * @brief Maximum allocation size of this memory pool library. All allocations
- *        must be a power of two and must be expressed by a 32-bit signed
- *        integer. Hence the largest allocation is 0x40000000 or 1073741824.
+ *        are rounded up to a power of two, the largest being 2^46 (64 TiB).
+ */
+#define MPLITE_MAX_ALLOC_SIZE    ((uint64_t) 1 << 46)
+/**
+ * @brief Alignment of the pool of large memory spaces (at least 64 times
+ *        this), so blocks of this size or more are aligned to it as well.
  */
-#define MPLITE_MAX_ALLOC_SIZE    0x40000000
+#ifndef MPLITE_POOL_ALIGN
+#define MPLITE_POOL_ALIGN    0x1000
+#endif
+/**
+ * @brief Minimum number of bytes of the pool carved into free blocks at a
+ *        time. The pool is carved lazily, doubling whenever no free block
+ *        is large enough for an allocation, so metadata is only touched for
+ *        the part of the pool in use.
+ */
+#ifndef MPLITE_CARVE_SIZE
+#define MPLITE_CARVE_SIZE    0x10000
+#endif
+/**
+ * @brief Size of the runs small allocations are carved from, see
+ *        @ref mplite_init_runs. Runs are blocks of the pool, so this must be
+ *        a power of two.
+ */
+#ifndef MPLITE_RUN_SIZE
+#define MPLITE_RUN_SIZE    0x1000
+#endif
+/**
+ * @brief Maximum number of slot sizes of runs.
+ */
+#define MPLITE_RUN_CLASSES    15
+/**
+ * @brief Number of block sizes, from mplite_t.szAtom up, whose freed blocks
+ *        are kept on quick lists rather than merged with their buddies.
+ */
+#define MPLITE_QUICK_ORDERS    8
+/**
+ * @brief Number of blocks a quick list holds before it is merged.
+ */
+#define MPLITE_QUICK_SIZE    16
+/**
+ * @brief Maximum number of levels of a free block bitmap, enough for 2^63
+ *        blocks.
+ */
+#define MPLITE_BITMAP_LEVELS    11
 /**
  * @brief An indicator that a function is a public API
  */
@@ -93,8 +138,12 @@ typedef struct mplite {
     /*-------------------------------
       Memory available for allocation
       -------------------------------*/
-    int szAtom; /**< Smallest possible allocation in bytes */
-    int nBlock; /**< Number of szAtom sized blocks in zPool */
+    size_t szAtom; /**< Smallest possible allocation in bytes */
+    int64_t nBlock; /**< Number of szAtom sized blocks carved in zPool */
+    int64_t nBlockLimit; /**< Number of blocks in the memory space so far,
+        up to which zPool is carved lazily */
+    int64_t nBlockMax; /**< Number of blocks zPool can grow to, see
+        @ref mplite_grow */
     uint8_t *zPool; /**< Memory available to be allocated */
 
     mplite_lock_t lock; /**< Lock to control access to the memory allocation
@@ -107,19 +156,38 @@ typedef struct mplite {
     uint64_t totalAlloc; /**< Total of all malloc calls - includes internal
         fragmentation */
     uint64_t totalExcess; /**< Total internal fragmentation */
-    uint32_t currentOut; /**< Current checkout, including internal
+    uint64_t currentOut; /**< Current checkout, including internal
         fragmentation */
-    uint32_t currentCount; /**< Current number of distinct checkouts */
-    uint32_t maxOut; /**< Maximum instantaneous currentOut */
-    uint32_t maxCount; /**< Maximum instantaneous currentCount */
-    uint32_t maxRequest; /**< Largest allocation (exclusive of internal frag) */
+    uint64_t currentCount; /**< Current number of distinct checkouts */
+    uint64_t maxOut; /**< Maximum instantaneous currentOut */
+    uint64_t maxCount; /**< Maximum instantaneous currentCount */
+    uint64_t maxRequest; /**< Largest allocation (exclusive of internal frag) */
 
-    int aiFreelist[MPLITE_LOGMAX + 1]; /**< List of free blocks. aiFreelist[0]
-        is a list of free blocks of size mplite_t.szAtom. aiFreelist[1] holds
-        blocks of size szAtom * 2 and so forth.*/
+    uint64_t freeMask; /**< Bit k is set if there are free blocks of size
+        mplite_t.szAtom * 2^k */
+    int64_t aiBitmap[MPLITE_LOGMAX + 1]; /**< Offset of the bitmap of free blocks
+        of each size in mplite_t.aBitmap. The bitmap of blocks of size
+        szAtom * 2^k has one bit per aligned block of that size, followed by
+        summary levels with one bit per non-zero word of the level below, up
+        to a single word. */
 
     uint8_t *aCtrl; /**< Space for tracking which blocks are checked out and the
-        size of each block.  One byte per block. */
+        size of each block.  One byte per block, for up to
+        mplite_t.nBlockMax blocks. Lives at the start of the buffer. */
+    uint64_t *aBitmap; /**< Free block bitmaps, right after aCtrl. */
+
+    size_t szSlot; /**< Slot size granularity of runs, or 0 if allocations
+        smaller than szAtom take a whole block. See @ref mplite_init_runs */
+    int64_t aiRun[MPLITE_RUN_CLASSES]; /**< First run with free slots of
+        size szSlot * (k+1), or -1. Such runs are linked through their
+        headers. */
+
+    int nQuick[MPLITE_QUICK_ORDERS]; /**< Number of blocks on each quick
+        list */
+    int64_t aiQuick[MPLITE_QUICK_ORDERS][MPLITE_QUICK_SIZE]; /**< Freed
+        blocks of size szAtom * 2^k not merged with their buddies yet, most
+        recently freed last. Quick lists are merged once full, or when no
+        free block is large enough for an allocation. */
 } mplite_t;
 
 /**
@@ -159,16 +227,68 @@ extern "C" {
  *         parameters error.
  */
 MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
-                                   const int buf_size, const int min_alloc,
+                                   const size_t buf_size,
+                                   const size_t min_alloc,
                                    const mplite_lock_t *lock);
 
+/**
+ * @brief Initialize a memory pool object which can later grow in place.
+ * @param[in,out] handle Pointer to a @ref mplite_t object, see
+ *                       @ref mplite_init.
+ * @param[in] buf Pointer to the start of the memory space.
+ * @param[in] buf_size The number of bytes of memory space currently usable
+ *                     at @ref buf. It must cover the control bytes and
+ *                     free block bitmaps for max_buf_size, which are about
+ *                     1.25/szAtom of it. They are only written as the
+ *                     pool is carved.
+ * @param[in] max_buf_size The number of bytes the memory space pointed to
+ *                         by @ref buf can be grown to with
+ *                         @ref mplite_grow.
+ * @param[in] min_alloc Minimum size of an allocation, see @ref mplite_init.
+ * @param[in] lock Pointer to a lock object, see @ref mplite_init.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_init_growable(mplite_t *handle, const void *buf,
+                                   const size_t buf_size,
+                                   const size_t max_buf_size,
+                                   const size_t min_alloc,
+                                   const mplite_lock_t *lock);
+
+/**
+ * @brief Grow the memory pool in place. The new tail of the memory space is
+ *        added to the pool, which carves it into free blocks merged with
+ *        their free buddies as allocations need them.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] buf_size The new number of bytes of memory space usable at the
+ *                     buf passed to @ref mplite_init_growable. Anything
+ *                     beyond max_buf_size is ignored.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error.
+ */
+MPLITE_API int mplite_grow(mplite_t *handle, const size_t buf_size);
+
+/**
+ * @brief Serve allocations smaller than mplite_t.szAtom from runs, blocks of
+ *        @ref MPLITE_RUN_SIZE bytes carved into equally sized slots, rather
+ *        than rounding them up to a whole block. Each run tracks its free
+ *        slots in a bitmap in its header.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @param[in] slot_size Granularity of the slot sizes, a power of two of at
+ *                      least 8 and at most half of mplite_t.szAtom. Slots
+ *                      are aligned to it, up to 16 bytes.
+ * @return @ref MPLITE_OK on success and @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error, e.g., if runs are already in use.
+ */
+MPLITE_API int mplite_init_runs(mplite_t *handle, const size_t slot_size);
+
 /**
  * @brief Allocate bytes of memory
  * @param[in,out] handle Pointer to an initialized @ref mplite_t object
  * @param[in] nBytes Number of bytes to allocate
  * @return Non-NULL on success, NULL otherwise
  */
-MPLITE_API void *mplite_malloc(mplite_t *handle, const int nBytes);
+MPLITE_API void *mplite_malloc(mplite_t *handle, const size_t nBytes);
 
 /**
  * @brief Free memory
@@ -190,7 +310,7 @@ MPLITE_API void mplite_free(mplite_t *handle, const void *pPrior);
  * @return Non-NULL on success, NULL otherwise
  */
 MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
-                                        const int nBytes);
+                                        const size_t nBytes);
 
 /**
  * @brief Round up a request size to the next valid allocation size.
@@ -199,7 +319,20 @@ MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
  * @return Positive non-zero value if the size can be allocated or zero if the
  *         allocation is too large to be handled.
  */
-MPLITE_API int mplite_roundup(mplite_t *handle, const int n);
+MPLITE_API size_t mplite_roundup(mplite_t *handle, const size_t n);
+
+/**
+ * @brief Repair the free block bitmaps of a memory pool after an operation
+ *        on it was interrupted, e.g., by the death of the lock owner. The
+ *        bitmaps and checkout statistics are rebuilt from the control bytes,
+ *        which every operation keeps describing a valid set of blocks.
+ *        Blocks checked out by the interrupted operation may leak.
+ * @param[in,out] handle Pointer to an initialized @ref mplite_t object
+ * @return @ref MPLITE_OK on success, @ref MPLITE_ERR_INVPAR on invalid
+ *         parameters error and @ref MPLITE_ERR_CORRUPT if the control bytes
+ *         are corrupt.
+ */
+MPLITE_API int mplite_repair(mplite_t *handle);
 
 /**
  * @brief Print the statistics of the memory pool object
@@ -4,7 +4,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
@@ -25,24 +27,44 @@
 /* General definitions. */
 #define SHALLOC_PAGE_SIZE                   ((size_t) 0x1000)
 
+#ifndef SHALLOC_HUGE_PAGE_SIZE
+#  define SHALLOC_HUGE_PAGE_SIZE            ((size_t) 0x200000)
+#endif
+
 #ifndef SHALLOC_PRIVATE_HEAP_SIZE
 #  define SHALLOC_PRIVATE_HEAP_SIZE         (SHALLOC_PAGE_SIZE)
 #endif
 
+/* The private heap is growable up to this size. */
+#ifndef SHALLOC_PRIVATE_HEAP_MAX_SIZE
+#  define SHALLOC_PRIVATE_HEAP_MAX_SIZE     (4096*SHALLOC_PAGE_SIZE)
+#endif
+
 #ifndef SHALLOC_DEFAULT_MMAP_FLAGS
 #  define SHALLOC_DEFAULT_MMAP_FLAGS        (MAP_ANONYMOUS|MAP_PRIVATE)
 #endif
 
+/* Unused parts of the shadow space are reserved, but inaccessible. */
+#define SHALLOC_RESERVE_MMAP_FLAGS \
+    (MAP_ANONYMOUS|MAP_PRIVATE|MAP_NORESERVE)
+
+/*
+ * Default shadow space location. Both can be overridden at init time,
+ * through shalloc_space_init_at() or the environment variables below.
+ */
 #ifndef SHALLOC_BASE_ADDR
 #  ifdef __MINIX
-#    define SHALLOC_BASE_ADDR               ((unsigned) 0xA0000000)
-#    define SHALLOC_LAST_ADDR               ((unsigned) 0xBFFFFFFF)
+#    define SHALLOC_BASE_ADDR               ((size_t) 0xA0000000)
+#    define SHALLOC_LAST_ADDR               ((size_t) 0xBFFFFFFF)
 #  else
-#    define SHALLOC_BASE_ADDR               ((unsigned) 0x80000000)
-#    define SHALLOC_LAST_ADDR               ((unsigned) 0xBFFFFFFF)
+#    define SHALLOC_BASE_ADDR               ((size_t) 0x80000000)
+#    define SHALLOC_LAST_ADDR               ((size_t) 0xBFFFFFFF)
 #  endif
 #endif
 
+#define SHALLOC_BASE_ADDR_ENV               "SHALLOC_BASE_ADDR"
+#define SHALLOC_SPACE_SIZE_ENV              "SHALLOC_SPACE_SIZE"
+
 #ifndef SHALLOC_USE_GUARD_PAGES
 #  ifdef __MINIX
 #    define SHALLOC_USE_GUARD_PAGES         0
@@ -64,6 +86,7 @@ enum shalloc_flags {
     HEAP = 0,
     NON_RESIZABLE,
     ELASTIC,
+    GUARD,
     __NUM_SHALLOC_FLAGS
 };
 #define SHALLOC_FLAG(F) (1 << (F))
@@ -75,9 +98,12 @@ typedef void* (*shalloc_malloc_t)(void* ref, size_t size);
 typedef void  (*shalloc_free_t)(void* ref, void *ptr);
 typedef void* (*shalloc_calloc_t)(void* ref, size_t nmemb,
     size_t size);
+typedef int   (*shalloc_extend_t)(void* ref, size_t size);
+typedef int   (*shalloc_repair_t)(void* ref);
 
 void* gen_memset_calloc(void *ref, size_t nmemb, size_t size);
 void gen_empty_destroy(void *ref);
+int gen_empty_extend(void *ref, size_t size);
 
 /* Shadow buffer definitions. */
 enum shalloc_buff_alloc_type {
@@ -96,12 +122,15 @@ typedef struct shalloc_buff_op_s {
     shalloc_malloc_t malloc;
     shalloc_free_t free;
     shalloc_calloc_t calloc;
+    shalloc_extend_t extend; /* NULL if the buffer cannot grow in place */
+    shalloc_repair_t repair; /* NULL if the state cannot be repaired */
 } shalloc_buff_op_t;
 
 typedef struct shalloc_buff_s {
     void *start;
     void *end;
     size_t size;
+    size_t max_size;
     size_t unused_size;
     size_t block_size;
     struct shalloc_buff_s *next;
@@ -129,6 +158,20 @@ typedef struct {
     size_t last_buff_size;
 } shalloc_region_info_t;
 
+/*
+ * Physical memory usage of a heap, region or buffer, in pages of
+ * SHALLOC_PAGE_SIZE. Resident pages include pages only read so far, which
+ * map the shared zero page in private heaps. Dirty pages are resident
+ * pages with memory of their own that cannot simply be dropped, so pages
+ * of file heaps never are (writeback is up to the page cache).
+ */
+typedef struct {
+    size_t size;
+    size_t resident_pages;
+    size_t dirty_pages;
+    size_t swapped_pages;
+} shalloc_usage_t;
+
 #define SHALLOC_REGION_TYPE_DEFAULT         SHALLOC_BUFF_ALLOC_TYPE_NOFREE
 #define SHALLOC_REGION_BUFF_SIZE_DEFAULT    SHALLOC_PAGE_SIZE
 #define SHALLOC_REGION_BUFF_ITER(R,PREV,CURR,DO) do { \
@@ -146,26 +189,248 @@ typedef struct {
 typedef struct {
     shalloc_buff_t base;
     shalloc_region_t region;
-    int inherit_id; 
+    int inherit_id; /* fd backing inherit and file heaps, see below */
     int mmap_flags;
+    int numa_node;
+    int frozen; /* SHALLOC_HEAP_FROZEN or SHALLOC_HEAP_SEALED if set */
+    unsigned gen; /* bumped whenever an inherit table slot is reused */
+    pthread_mutex_t lock; /* robust and process-shared, see below */
 } shalloc_heap_t;
 
-#define SHALLOC_MAX_INHERIT_HEAPS       10
+/*
+ * Allocations from inherit heaps are serialized by the lock in their
+ * descriptor, which lives in the shared inherit table. When its owner dies
+ * mid-operation, the next process to lock the heap repairs the allocator
+ * metadata with the repair buffer op, or marks the heap unrecoverable
+ * (allocations fail from then on) if it cannot. Regions within inherit
+ * heaps are not covered.
+ */
+
+/*
+ * Frozen heaps are mapped read-only and allocations from them, or from
+ * regions within them, fail, so readers need no synchronization. Freezing
+ * protects the mapping of the calling process only, other processes sharing
+ * an inherit heap see the state and fail allocations, while processes
+ * mapping it later do so read-only. Thawing an inherit heap bumps the
+ * thaw_gen of the space, so other processes remap the thawed heaps they
+ * still map read-only on their next allocation from an inherit heap.
+ * Sealed inherit heaps are frozen for good: their memfd denies new
+ * writable mappings and the heap is remapped so it cannot be made writable
+ * again.
+ */
+#define SHALLOC_HEAP_FROZEN             1
+#define SHALLOC_HEAP_SEALED             2
+
+/*
+ * NUMA placement of heaps. A heap is bound to a node, interleaved across
+ * all online nodes, or left to first touch (SHALLOC_NUMA_ANY).
+ */
+#define SHALLOC_NUMA_ANY                (-1)
+#define SHALLOC_NUMA_INTERLEAVE         (-2)
+
+#ifndef SHALLOC_NUMA_MAX_NODES
+#  define SHALLOC_NUMA_MAX_NODES        64
+#endif
+
+typedef struct {
+    shalloc_heap_t *heaps[SHALLOC_NUMA_MAX_NODES];
+} shalloc_numa_heaps_t;
+
 #define SHALLOC_INHERIT_ID              "inherit_id"
+
+/*
+ * Named spaces can be attached to by unrelated processes. Their shared
+ * segments are POSIX shared memory objects named after the space (and the
+ * table slot of each inherit heap), which every process opens by name, as
+ * fd numbers are per process. Inherit heaps of named spaces have their
+ * inherit_id set to SHALLOC_HEAP_NAMED.
+ *
+ * Heaps are created and destroyed under the lock in the control pages, so
+ * processes sharing them never claim the same table slot or address range.
+ * Inherit heaps are placed top down, above the private heaps of every
+ * process, and each process maps the heaps its peers create (in named
+ * spaces) as it first looks up a pointer into them or creates a heap.
+ */
+#define SHALLOC_SPACE_NAME_ENV          "SHALLOC_SPACE_NAME"
+#define SHALLOC_SPACE_NAME_MAX          32
+#define SHALLOC_HEAP_NAMED              (-2)
 #define SHALLOC_MAP_INHERIT             0x0800
+
+/*
+ * Shalloc-specific mmap flags, never passed on to mmap(). Heaps with
+ * SHALLOC_MAP_HUGEPAGE (or MAP_HUGETLB) are huge page aligned and sized.
+ */
+#define SHALLOC_MAP_HUGEPAGE            0x0400
+
+/*
+ * Growable heaps reserve address space for their maximum size up front and
+ * commit it on demand, so they grow in place. Set by
+ * shalloc_heap_create_growable().
+ */
+#define SHALLOC_MAP_GROWABLE            0x0200
+
+/*
+ * Non-inherit heap descriptors are carved out of chunks of this size in the
+ * private heap and recycled through a free list.
+ */
+#define SHALLOC_HEAP_DESC_CHUNK_SIZE    SHALLOC_PAGE_SIZE
+
+/*
+ * Growable heaps commit at least 1/SHALLOC_HEAP_GROWABLE_MIN_FRACTION of
+ * their maximum size on creation, room for allocator metadata (mplite
+ * keeps its control bytes for the whole heap at the start).
+ */
+#ifndef SHALLOC_HEAP_GROWABLE_MIN_FRACTION
+#  define SHALLOC_HEAP_GROWABLE_MIN_FRACTION  32
+#endif
+
+/*
+ * Guard page policy of a heap. By default (no guard flag), heaps get a
+ * trailing guard page if SHALLOC_USE_GUARD_PAGES is set, carved out of the
+ * data of heaps over 100 pages. Otherwise, there are no guards, a trailing
+ * guard page or guards on both sides (the leading one is a full heap page,
+ * to keep huge page heaps aligned). Guards are left reserved, so they cost
+ * no mmap() calls, but they keep adjacent heaps in separate VMAs.
+ */
+#define SHALLOC_MAP_GUARD_NONE          0x200000
+#define SHALLOC_MAP_GUARD_TRAIL         0x400000
+#define SHALLOC_MAP_GUARD_AROUND        0x600000
+#define SHALLOC_MAP_GUARD_MASK          0x600000
+
+/*
+ * File-backed heaps map a file MAP_SHARED at a fixed address. The file
+ * starts with a header (one heap page), followed by the heap data with the
+ * allocator metadata, so shalloc_heap_open() can map it back at the same
+ * address. Only the heap allocator state persists, regions created inside
+ * the heap do not. Set by shalloc_heap_create_file().
+ */
+#define SHALLOC_MAP_FILE                0x800000
+
+/*
+ * Heaps with SHALLOC_MAP_TRACK_DIRTY have their written pages tracked, so
+ * a checkpoint into the directory of the previous one only writes the
+ * pages modified since. Ignored for inherit heaps, which other processes
+ * can write to. Needs userfaultfd asynchronous write protection (Linux
+ * 6.7), otherwise heaps are always checkpointed in full.
+ */
+#define SHALLOC_MAP_TRACK_DIRTY         0x1000000
+
+/*
+ * Fork policy of a heap. Private heaps are copy-on-write in children by
+ * default, MAP_SHARED heaps are shared with them. Heaps can instead be
+ * wiped (children see zeros and must shalloc_region_reset() the heap
+ * before use) or dropped (children must not touch them at all). Wiping
+ * only works for private anonymous heaps. Set at creation with the flags
+ * below, or later with shalloc_heap_set_fork_policy().
+ */
+#define SHALLOC_MAP_WIPEONFORK          0x2000000
+#define SHALLOC_MAP_DONTFORK            0x0080
+#define SHALLOC_MAP_FORK_MASK \
+    (SHALLOC_MAP_WIPEONFORK|SHALLOC_MAP_DONTFORK)
+
+enum shalloc_fork_policy {
+    SHALLOC_FORK_COPY = 0,
+    SHALLOC_FORK_SHARE,
+    SHALLOC_FORK_WIPE,
+    SHALLOC_FORK_DROP
+};
+
+/*
+ * Prefaulting and locking of heap pages, done as pages are committed,
+ * after the NUMA policy is set. MAP_POPULATE prefaults pages in the caller
+ * and MAP_LOCKED locks them in memory. With MAP_NONBLOCK nothing is
+ * faulted in by the caller: SHALLOC_MAP_PREFAULT_ASYNC hands the pages to
+ * a background thread and SHALLOC_MAP_LOCK_ONFAULT locks pages as they
+ * are first touched (by that thread, if both are set).
+ */
+#define SHALLOC_MAP_PREFAULT_ASYNC      (MAP_POPULATE|MAP_NONBLOCK)
+#define SHALLOC_MAP_LOCK_ONFAULT        (MAP_LOCKED|MAP_NONBLOCK)
+#define SHALLOC_MAP_PREFAULT_MASK \
+    (MAP_POPULATE|MAP_LOCKED|MAP_NONBLOCK)
+
+#define SHALLOC_MAP_PSEUDO_FLAGS \
+    (SHALLOC_MAP_INHERIT|SHALLOC_MAP_HUGEPAGE|SHALLOC_MAP_GROWABLE \
+    |SHALLOC_MAP_GUARD_MASK|SHALLOC_MAP_FILE|SHALLOC_MAP_TRACK_DIRTY \
+    |SHALLOC_MAP_FORK_MASK)
+
+#define SHALLOC_FILE_MAGIC              0x5348414c
+#define SHALLOC_FILE_VERSION            6
+
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    void *base_addr;
+    size_t base_size;
+    size_t data_size;
+    size_t size; /* size requested at creation */
+    int mmap_flags;
+    int alloc_type;
+    void *root;
+} shalloc_file_header_t;
 #define SHALLOC_GET_EXEC_ENVP()         (SHALLOC_CONTROL_DATA->inherit_envp)
 
-/* Shadow magic info */
+/* Shadow range definitions. */
+typedef struct {
+    char *start;
+    size_t size;
+} shalloc_range_t;
+
+#define SHALLOC_RANGES_INIT_SIZE        16
+
+/* Inherit heaps as known to this process, indexed by table slot. */
 typedef struct {
-    char *inherit_envp[2];
-    char inherit_envp_buff[32];
+    char *start;
+    size_t size;
+    unsigned gen; /* gen of the heap in the slot, 0 if none */
+    int mapped;
+    int fd; /* memfd to close once the heap is gone, or -1 */
+} shalloc_inherit_slot_t;
+
+/*
+ * Shadow magic info. The control and inherit pages are followed by the
+ * inherit heap table in the same shared segment. The table grows on
+ * demand within a range of SHALLOC_INHERIT_TABLE_MAX_SIZE bytes, which the
+ * segment always covers sparsely and every process maps in full, so
+ * descriptors never move and growing never needs a remap.
+ */
+#define SHALLOC_MAGIC_PAGES_SIZE        (2*SHALLOC_PAGE_SIZE)
+
+#ifndef SHALLOC_INHERIT_TABLE_MAX_SIZE
+#  define SHALLOC_INHERIT_TABLE_MAX_SIZE  (1024*SHALLOC_PAGE_SIZE)
+#endif
+
+typedef struct {
+    char *inherit_envp[4];
+    char inherit_envp_buff[64];
+    char base_envp_buff[48];
+    char size_envp_buff[48];
+    char name[SHALLOC_SPACE_NAME_MAX];
+    void *base_addr;
+    size_t size;
     int inherit_id;
     int num_heaps;
-    shalloc_heap_t heap_list[SHALLOC_MAX_INHERIT_HEAPS];
+    int max_heaps;
+    size_t table_size;
+    unsigned thaw_gen; /* bumped by every thaw of an inherit heap */
+    pthread_mutex_t lock; /* robust and process-shared, see above */
+    char *private_end; /* end of the highest private heap of any process */
+    int new_slot; /* slot of the heap being created, or -1 */
+    shalloc_heap_t *heap_list;
 } shalloc_magic_t;
 
+/*
+ * Reverse pointer map, one entry per chunk of the shadow space, placed
+ * after the inherit heap table. Regions inherited across exec() are only
+ * known to the map through their heap.
+ */
+#define SHALLOC_PTRMAP_CHUNK_SIZE       ((size_t) 0x200000)
+#define SHALLOC_PTRMAP_SIZE(S) \
+    ((((S)/SHALLOC_PTRMAP_CHUNK_SIZE + 1)*sizeof(uintptr_t) \
+    + SHALLOC_PAGE_SIZE - 1) & ~(SHALLOC_PAGE_SIZE - 1))
+
 /* Make SHALLOC_BUFF_ALLOC_TYPE_MPLITE the default heap allocator.
- * - SHALLOC_BUFF_ALLOC_TYPE_MPLITE wastes more memory (see MPLITE_MIN_ALLOC)
+ * - SHALLOC_BUFF_ALLOC_TYPE_MPLITE rounds sizes up to powers of two, and
+ *   small ones to multiples of the heap block size (see MPLITE_SLOT_SIZE)
  * - SHALLOC_BUFF_ALLOC_TYPE_SIMPLE seems buggy
  * - SHALLOC_BUFF_ALLOC_TYPE_BUFFER has problems with large allocations
  */
@@ -178,9 +443,18 @@ typedef struct {
     void *magic_control_page;
     void *magic_inherit_page;
     int num_heaps;
-    int has_noninherit_heaps;
     int mmap_flags;
+    shalloc_range_t *free_ranges;
+    int num_free_ranges;
+    int max_free_ranges;
+    shalloc_inherit_slot_t *inherit_slots;
+    int max_inherit_slots;
+    shalloc_heap_t *free_heap_descs;
+    uintptr_t *ptr_map;
     shalloc_heap_t *priv_heap;
+    int control_fd;
+    unsigned thaw_gen; /* last thaw_gen applied to our mappings */
+    uint64_t ckpt_id;
     shalloc_buff_op_t buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES];
 } shalloc_space_t;
 extern shalloc_space_t *shalloc_space;
@@ -198,12 +472,34 @@ void shalloc_region_print(shalloc_region_t *region);
 
 /* Shalloc allocator interface. */
 void shalloc_buff_reset(shalloc_buff_t* buff);
+int shalloc_buff_get_usage(shalloc_buff_t *buff, shalloc_usage_t *usage);
 
 shalloc_heap_t* shalloc_heap_create(size_t size, int mmap_flags,
     enum shalloc_buff_alloc_type type);
+shalloc_heap_t* shalloc_heap_create_with_block_size(size_t size,
+    size_t block_size, int mmap_flags, enum shalloc_buff_alloc_type type);
+shalloc_heap_t* shalloc_heap_create_growable(size_t size, size_t max_size,
+    int mmap_flags, enum shalloc_buff_alloc_type type);
+int shalloc_heap_grow(shalloc_heap_t* heap, size_t size);
+shalloc_heap_t* shalloc_heap_create_on_node(size_t size, int mmap_flags,
+    enum shalloc_buff_alloc_type type, int node);
+shalloc_heap_t* shalloc_heap_create_file(const char *path, size_t size,
+    int mmap_flags, enum shalloc_buff_alloc_type type);
+shalloc_heap_t* shalloc_heap_open(const char *path);
+void shalloc_heap_set_root(shalloc_heap_t* heap, void *root);
+void* shalloc_heap_get_root(shalloc_heap_t* heap);
+int shalloc_heap_sync(shalloc_heap_t* heap);
+int shalloc_heap_set_fork_policy(shalloc_heap_t* heap,
+    enum shalloc_fork_policy policy);
+int shalloc_heap_freeze(shalloc_heap_t* heap);
+int shalloc_heap_thaw(shalloc_heap_t* heap);
+int shalloc_heap_seal(shalloc_heap_t* heap);
+int shalloc_heap_get_usage(shalloc_heap_t* heap, shalloc_usage_t *usage);
 shalloc_region_t* shalloc_heap_to_region(shalloc_heap_t* heap);
 shalloc_buff_t* shalloc_heap_to_buff(shalloc_heap_t* heap);
 shalloc_heap_t* shalloc_region_to_heap(shalloc_region_t* region);
+shalloc_region_t* shalloc_ptr_to_region(void *ptr);
+shalloc_heap_t* shalloc_ptr_to_heap(void *ptr);
 
 shalloc_region_t* shalloc_region_create(shalloc_region_t *region,
     size_t init_size, size_t buff_size,  size_t block_size, int flags,
@@ -212,16 +508,33 @@ void shalloc_region_destroy(shalloc_region_t* region);
 void shalloc_region_reset(shalloc_region_t* region);
 void shalloc_region_get_info(shalloc_region_t* region,
     shalloc_region_info_t *info);
+int shalloc_region_get_usage(shalloc_region_t* region,
+    shalloc_usage_t *usage);
 
 void* shalloc_malloc(shalloc_region_t *region, size_t size);
 void shalloc_free(shalloc_region_t *region, void *ptr);
+void shalloc_free_any(void *ptr);
 void* shalloc_calloc(shalloc_region_t *region, size_t nmemb, size_t size);
 void* shalloc_orealloc(shalloc_region_t *region, void *ptr, size_t size,
     size_t old_size);
 
 void shalloc_space_init();
+void shalloc_space_init_at(void *base_addr, size_t size);
+int shalloc_space_publish(const char *name);
+int shalloc_space_attach(const char *name);
+void shalloc_space_unlink(const char *name);
 void shalloc_space_close();
 void shalloc_space_freeze();
+shalloc_heap_t* shalloc_space_next_heap(shalloc_heap_t *heap);
+int shalloc_space_checkpoint(const char *dir);
+int shalloc_space_restore(const char *dir);
+
+int shalloc_numa_num_nodes();
+int shalloc_numa_node();
+int shalloc_numa_heaps_create(shalloc_numa_heaps_t *numa_heaps, size_t size,
+    int mmap_flags, enum shalloc_buff_alloc_type type);
+void shalloc_numa_heaps_destroy(shalloc_numa_heaps_t *numa_heaps);
+shalloc_heap_t* shalloc_numa_heaps_local(shalloc_numa_heaps_t *numa_heaps);
 #define SHALLOC_INHERIT_DATA     (shalloc_space->magic_inherit_page)
 #define SHALLOC_CONTROL_DATA     ((shalloc_magic_t*)shalloc_space->magic_control_page)
 
@@ -6,36 +6,80 @@
 #include <assert.h>
 
 /*
- ** A minimum allocation is an instance of the following structure.
- ** Larger allocations are an array of these structures where the
- ** size of the array is a power of 2.
- **
- ** The size of this object must be a power of two.  That fact is
- ** verified in mplite_init().
+ ** Free blocks are tracked in per-size bitmaps rather than in lists linked
+ ** through the blocks themselves, so free blocks are never touched. Finding
+ ** the lowest free block of a size takes one count of trailing zeros per
+ ** bitmap level, and (un)linking a block mostly updates a single word.
  */
-typedef struct mplite_link mplite_link_t;
+#define MPLITE_WORD_BITS     64
 
-struct mplite_link {
-    int next; /* Index of next free chunk */
-    int prev; /* Index of previous free chunk */
-};
+#ifdef __GNUC__
+#define mplite_ctz(x)        __builtin_ctzll(x)
+#else
+static int mplite_ctz(uint64_t x)
+{
+    int n;
+    for (n = 0; !(x & 1); x >>= 1, n++);
+    return n;
+}
+#endif /* #ifdef __GNUC__ */
 
 /*
  ** Masks used for mplite_t.aCtrl[] elements.
  */
-#define MPLITE_CTRL_LOGSIZE  0x1f    /* Log2 Size of this block */
-#define MPLITE_CTRL_FREE     0x20    /* True if not checked out */
+#define MPLITE_CTRL_LOGSIZE  0x3f    /* Log2 Size of this block */
+#define MPLITE_CTRL_FREE     0x40    /* True if not checked out */
+#define MPLITE_CTRL_RUN      0x80    /* True if carved into slots */
+#define MPLITE_CTRL_QUICK    (MPLITE_CTRL_FREE | MPLITE_CTRL_RUN)
+                                     /* Free but on a quick list */
+
+/*
+ ** Header of a run, a block of MPLITE_RUN_SIZE bytes carved into slots of
+ ** szSlot bytes after the header.  A run never hands out its first byte,
+ ** so a freed pointer is a slot if it lies in a run but not at its start.
+ */
+typedef struct mplite_run {
+    int64_t next; /* Next run with free slots of this size, or -1 */
+    int64_t prev; /* Previous run with free slots of this size, or -1 */
+    uint32_t szSlot; /* Size of the slots in bytes */
+    uint32_t nFree; /* Number of free slots */
+    uint64_t aFree[MPLITE_RUN_SIZE / 8 / MPLITE_WORD_BITS]; /* Free slots */
+} mplite_run_t;
+
+#define MPLITE_RUN_HDR       ((sizeof (mplite_run_t) + 63) & ~(size_t) 63)
 
 #ifdef _WIN32
 #define snprintf(buf, buf_size, format, ...)    _snprintf(buf, buf_size, format, ## __VA_ARGS__)
 #endif /* #ifdef _WIN32 */
 
 /*
- ** Assuming mplite_t.zPool is divided up into an array of mplite_link_t
- ** structures, return a pointer to the idx-th such lik.
+ ** Return the number of aligned blocks of size szAtom * 2^iLogsize in the
+ ** largest pool, i.e., of bits in the bitmap of that size.
+ */
+#define mplite_slots(handle, iLogsize)    \
+        ((((handle)->nBlockMax - 1) >> (iLogsize)) + 1)
+
+/*
+ ** Return the number of blocks of a run, and the number of slots of a run
+ ** of szSlot byte slots.
+ */
+#define mplite_run_blocks(handle)    \
+        ((int64_t) (MPLITE_RUN_SIZE / (handle)->szAtom))
+#define mplite_run_slots(szSlot)    \
+        ((int) ((MPLITE_RUN_SIZE - MPLITE_RUN_HDR) / (szSlot)))
+
+/*
+ ** Return the run at handle->aPool[idx].
  */
-#define mplite_getlink(handle, idx) ((mplite_link_t *)    \
-        (&handle->zPool[(idx) * handle->szAtom]))
+#define mplite_getrun(handle, idx) ((mplite_run_t *)    \
+        (&(handle)->zPool[(idx) * (handle)->szAtom]))
+
+/*
+ ** True if an allocation of n bytes is served from a run.
+ */
+#define mplite_is_small(handle, n)    ((handle)->szSlot != 0 &&    \
+        (n) <= (handle)->szAtom - (handle)->szSlot &&                \
+        ((n) - 1) / (handle)->szSlot < MPLITE_RUN_CLASSES)
 
 #define mplite_enter(handle)    if((handle != NULL) &&        \
         ((handle)->lock.acquire != NULL))                    \
@@ -44,32 +88,60 @@ struct mplite_link {
         ((handle)->lock.release != NULL))                    \
         { (handle)->lock.release((handle)->lock.arg); }
 
-static int mplite_logarithm(const int iValue);
-static int mplite_size(const mplite_t *handle, const void *p);
-static void mplite_link(mplite_t *handle, const int i,
+static int mplite_logarithm(const size_t iValue);
+static int64_t mplite_layout(mplite_t *handle);
+static size_t mplite_size(const mplite_t *handle, const void *p);
+static void mplite_link(mplite_t *handle, const int64_t i,
                             const int iLogsize);
-static void mplite_unlink(mplite_t *handle, const int i,
+static void mplite_unlink(mplite_t *handle, const int64_t i,
                               const int iLogsize);
-static int mplite_unlink_first(mplite_t *handle,
+static int64_t mplite_unlink_first(mplite_t *handle,
                                    const int iLogsize);
 static void *mplite_malloc_unsafe(mplite_t *handle,
-                                      const int nByte);
+                                      const size_t nByte);
 static void mplite_free_unsafe(mplite_t *handle,
                                    const void *pOld);
+static void mplite_release(mplite_t *handle, int64_t iBlock,
+                               int iLogsize);
+static void mplite_clear(mplite_t *handle, const int64_t nOld,
+                             const int64_t nNew);
+static void mplite_carve(mplite_t *handle, const int iLogsize);
+static void mplite_defer(mplite_t *handle, int64_t iBlock, int iLogsize);
+static void mplite_flush(mplite_t *handle, const int iLogsize);
+static void mplite_run_link(mplite_t *handle, const int64_t iRun);
+static void mplite_run_unlink(mplite_t *handle, const int64_t iRun);
+static int64_t mplite_run_find(const mplite_t *handle, const void *p);
+static void *mplite_run_malloc(mplite_t *handle, const size_t nByte);
+static void mplite_run_free(mplite_t *handle, const int64_t iRun,
+                                const void *pOld);
+static void mplite_run_reclaim(mplite_t *handle);
 
 MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
-                                   const int buf_size, const int min_alloc,
+                                   const size_t buf_size,
+                                   const size_t min_alloc,
                                    const mplite_lock_t *lock)
 {
-    int ii; /* Loop counter */
-    int nByte; /* Number of bytes of memory available to this allocator */
+    return mplite_init_growable(handle, buf, buf_size, buf_size, min_alloc,
+        lock);
+}
+
+MPLITE_API int mplite_init_growable(mplite_t *handle, const void *buf,
+                                   const size_t buf_size,
+                                   const size_t max_buf_size,
+                                   const size_t min_alloc,
+                                   const mplite_lock_t *lock)
+{
+    size_t nByte; /* Number of bytes of memory available to this allocator */
     uint8_t *zByte; /* Memory usable by this allocator */
     int nMinLog; /* Log base 2 of minimum allocation size in bytes */
-    int iOffset; /* An offset into handle->aCtrl[] */
+    size_t nAlign; /* Alignment of handle->zPool */
+    int64_t nAvail; /* Bytes left for the metadata and the pool */
+    int64_t nWord; /* Number of words of the free block bitmaps */
+    int64_t nExcess; /* Bytes by which the metadata and pool overflow */
 
     /* Check the parameters */
-    if ((NULL == handle) || (NULL == buf) || (buf_size <= 0) ||
-        (min_alloc <= 0)) {
+    if ((NULL == handle) || (NULL == buf) || (buf_size == 0) ||
+        (max_buf_size < buf_size) || (min_alloc == 0)) {
         return MPLITE_ERR_INVPAR;
     }
 
@@ -81,48 +153,107 @@ MPLITE_API int mplite_init(mplite_t *handle, const void *buf,
         memcpy(&handle->lock, lock, sizeof (handle->lock));
     }
 
-    /* The size of a mplite_link_t object must be a power of two.  Verify that
-     ** this is case.
-     */
-    assert((sizeof (mplite_link_t)&(sizeof (mplite_link_t) - 1)) == 0);
-
-    nByte = buf_size;
+    nByte = max_buf_size;
     zByte = (uint8_t*) buf;
 
     nMinLog = mplite_logarithm(min_alloc);
-    handle->szAtom = (1 << nMinLog);
-    while ((int) sizeof (mplite_link_t) > handle->szAtom) {
+    handle->szAtom = ((size_t) 1 << nMinLog);
+    while (sizeof (uint64_t) > handle->szAtom) {
         handle->szAtom = handle->szAtom << 1;
     }
+    if (nByte < 2 * handle->szAtom) {
+        return MPLITE_ERR_INVPAR;
+    }
 
-    handle->nBlock = (nByte / (handle->szAtom + sizeof (uint8_t)));
-    handle->zPool = zByte;
-    handle->aCtrl = (uint8_t *) & handle->zPool[handle->nBlock * handle->szAtom];
+    /* The control bytes and free block bitmaps for the largest pool come
+     ** first, so the pool can later grow at the end of the buffer.  The pool
+     ** itself is aligned to szAtom, or MPLITE_POOL_ALIGN for large pools,
+     ** which leaves at most nAlign-1 bytes of padding.  Each block costs a
+     ** control byte and about two bitmap bits, start from a slight
+     ** overestimate of the latter and shrink the pool until all fits.
+     */
+    nAlign = handle->szAtom;
+    if (nByte / 64 >= MPLITE_POOL_ALIGN && MPLITE_POOL_ALIGN > nAlign) {
+        nAlign = MPLITE_POOL_ALIGN;
+    }
+    nAvail = (int64_t) (nByte - nAlign + 1);
+    handle->nBlockMax = nAvail /
+            (4 * (int64_t) (handle->szAtom + sizeof (uint8_t)) + 1) * 4;
+    do {
+        if (handle->nBlockMax <= 0) {
+            return MPLITE_ERR_INVPAR;
+        }
+        nWord = mplite_layout(handle);
+        nExcess = ((handle->nBlockMax + 7) & ~7) +
+                nWord * (int64_t) sizeof (uint64_t) +
+                handle->nBlockMax * (int64_t) handle->szAtom - nAvail;
+        if (nExcess > 0) {
+            handle->nBlockMax -= nExcess / (int64_t) (handle->szAtom + 1) + 1;
+        }
+    } while (nExcess > 0);
+    handle->aCtrl = zByte;
+    handle->aBitmap = (uint64_t *) &zByte[(handle->nBlockMax + 7) & ~7];
+    handle->zPool = (uint8_t *) (((uintptr_t) &handle->aBitmap[nWord] +
+            nAlign - 1) & ~((uintptr_t) nAlign - 1));
+    handle->nBlock = 0;
+    handle->nBlockLimit = 0;
+    handle->freeMask = 0;
+
+    return mplite_grow(handle, buf_size);
+}
+
+MPLITE_API int mplite_grow(mplite_t *handle, const size_t buf_size)
+{
+    int64_t nBlock; /* Number of blocks in the grown pool */
 
-    for (ii = 0; ii <= MPLITE_LOGMAX; ii++) {
-        handle->aiFreelist[ii] = -1;
+    /* Check the parameters */
+    if ((NULL == handle) ||
+        (buf_size <= (size_t) (handle->zPool - handle->aCtrl))) {
+        return MPLITE_ERR_INVPAR;
+    }
+    nBlock = (int64_t) ((buf_size - (handle->zPool - handle->aCtrl)) /
+            handle->szAtom);
+    if (nBlock > handle->nBlockMax) {
+        nBlock = handle->nBlockMax;
     }
 
-    iOffset = 0;
-    for (ii = MPLITE_LOGMAX; ii >= 0; ii--) {
-        int nAlloc = (1 << ii);
-        if ((iOffset + nAlloc) <= handle->nBlock) {
-            handle->aCtrl[iOffset] = (uint8_t) (ii | MPLITE_CTRL_FREE);
-            mplite_link(handle, iOffset, ii);
-            iOffset += nAlloc;
-        }
-        assert((iOffset + nAlloc) > handle->nBlock);
+    /* The new blocks are carved by allocations that need them. */
+    mplite_enter(handle);
+    if (nBlock > handle->nBlockLimit) {
+        handle->nBlockLimit = nBlock;
+    }
+    mplite_leave(handle);
+
+    return MPLITE_OK;
+}
+
+MPLITE_API int mplite_init_runs(mplite_t *handle, const size_t slot_size)
+{
+    int ii; /* Loop counter */
+
+    /* Check the parameters */
+    if ((NULL == handle) || (handle->szSlot != 0) || (slot_size < 8) ||
+        (slot_size & (slot_size - 1)) || (slot_size > handle->szAtom / 2) ||
+        (handle->szAtom > MPLITE_RUN_SIZE / 2)) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    mplite_enter(handle);
+    for (ii = 0; ii < MPLITE_RUN_CLASSES; ii++) {
+        handle->aiRun[ii] = -1;
     }
+    handle->szSlot = slot_size;
+    mplite_leave(handle);
 
     return MPLITE_OK;
 }
 
-MPLITE_API void *mplite_malloc(mplite_t *handle, const int nBytes)
+MPLITE_API void *mplite_malloc(mplite_t *handle, const size_t nBytes)
 {
     int64_t *p = 0;
 
     /* Check the parameters */
-    if ((NULL == handle) || (nBytes <= 0)) {
+    if ((NULL == handle) || (nBytes == 0)) {
         return NULL;
     }
 
@@ -146,13 +277,13 @@ MPLITE_API void mplite_free(mplite_t *handle, const void *pPrior)
 }
 
 MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
-                                        const int nBytes)
+                                        const size_t nBytes)
 {
-    int nOld;
+    size_t nOld;
     void *p;
 
     /* Check the parameters */
-    if ((NULL == handle) || (NULL == pPrior) || (nBytes <= 0) ||
+    if ((NULL == handle) || (NULL == pPrior) || (nBytes == 0) ||
         (nBytes & (nBytes - 1))) {
         return NULL;
     }
@@ -172,9 +303,9 @@ MPLITE_API void *mplite_realloc(mplite_t *handle, const void *pPrior,
     return p;
 }
 
-MPLITE_API int mplite_roundup(mplite_t *handle, const int n)
+MPLITE_API size_t mplite_roundup(mplite_t *handle, const size_t n)
 {
-    int iFullSz;
+    size_t iFullSz;
 
     /* Check the parameters */
     if ((NULL == handle) || (n > MPLITE_MAX_ALLOC_SIZE)) {
@@ -186,41 +317,143 @@ MPLITE_API int mplite_roundup(mplite_t *handle, const int n)
     return iFullSz;
 }
 
+MPLITE_API int mplite_repair(mplite_t *handle)
+{
+    int64_t ii; /* Loop counter */
+    int64_t i; /* Index of a handle->aPool[] slot */
+    int iLogsize; /* Log2 of the size of slot i */
+    int64_t size; /* Size of slot i in blocks */
+    uint64_t *aWord; /* Bitmap of the free blocks of size iLogsize */
+    uint64_t w; /* Free even blocks whose odd buddy is free as well */
+    mplite_run_t *pRun; /* Run at slot i */
+    int iSlot; /* Slot of pRun */
+
+    /* Check the parameters */
+    if (NULL == handle) {
+        return MPLITE_ERR_INVPAR;
+    }
+
+    /* Walk the blocks and mark the free ones in the bitmaps again, along
+     ** with those on the quick lists. A block being split or merged still
+     ** shows up as a single free block here, as the control byte of its
+     ** head is updated last by a split and first by a merge.
+     */
+    mplite_layout(handle);
+    mplite_clear(handle, 0, handle->nBlock);
+    handle->freeMask = 0;
+    handle->currentCount = 0;
+    handle->currentOut = 0;
+    for (ii = 0; ii < MPLITE_RUN_CLASSES; ii++) {
+        handle->aiRun[ii] = -1;
+    }
+    for (ii = 0; ii < MPLITE_QUICK_ORDERS; ii++) {
+        handle->nQuick[ii] = 0;
+    }
+    if (handle->nBlock > handle->nBlockLimit ||
+        handle->nBlockLimit > handle->nBlockMax) {
+        return MPLITE_ERR_CORRUPT;
+    }
+    for (i = 0; i < handle->nBlock; i += size) {
+        iLogsize = handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE;
+        if (iLogsize > MPLITE_LOGMAX) {
+            return MPLITE_ERR_CORRUPT;
+        }
+        size = (int64_t) 1 << iLogsize;
+        if ((i & (size - 1)) != 0 || i + size > handle->nBlock) {
+            return MPLITE_ERR_CORRUPT;
+        }
+        if (handle->aCtrl[i] & MPLITE_CTRL_FREE) {
+            handle->aCtrl[i] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
+            mplite_link(handle, i, iLogsize);
+        }
+        else {
+            handle->currentCount++;
+            handle->currentOut += size * handle->szAtom;
+        }
+
+        /* Recount the free slots of runs, whose header is complete
+         ** before they are marked, and put them back on their lists.
+         */
+        if ((handle->aCtrl[i] & (MPLITE_CTRL_FREE | MPLITE_CTRL_RUN)) ==
+            MPLITE_CTRL_RUN) {
+            pRun = mplite_getrun(handle, i);
+            if (!handle->szSlot || size != mplite_run_blocks(handle) ||
+                pRun->szSlot % handle->szSlot != 0 ||
+                !mplite_is_small(handle, pRun->szSlot)) {
+                return MPLITE_ERR_CORRUPT;
+            }
+            pRun->nFree = 0;
+            for (iSlot = 0; iSlot < mplite_run_slots(pRun->szSlot); iSlot++) {
+                if (pRun->aFree[iSlot / MPLITE_WORD_BITS] &
+                    ((uint64_t) 1 << (iSlot % MPLITE_WORD_BITS))) {
+                    pRun->nFree++;
+                }
+            }
+            if (pRun->nFree > 0) {
+                mplite_run_link(handle, i);
+            }
+            if (pRun->nFree == (uint32_t) mplite_run_slots(pRun->szSlot)) {
+                handle->currentCount--;
+                handle->currentOut -= size * handle->szAtom;
+            }
+        }
+    }
+
+    /* Merge the free buddies an interrupted free left behind. */
+    for (iLogsize = 0; iLogsize < MPLITE_LOGMAX &&
+        ((int64_t) 1 << iLogsize) <= handle->nBlockMax; iLogsize++) {
+        aWord = &handle->aBitmap[handle->aiBitmap[iLogsize]];
+        for (ii = 0; ii * MPLITE_WORD_BITS <
+            (handle->nBlock >> iLogsize); ii++) {
+            while ((w = aWord[ii] & (aWord[ii] >> 1) &
+                0x5555555555555555ULL) != 0) {
+                i = (ii * MPLITE_WORD_BITS + mplite_ctz(w)) << iLogsize;
+                mplite_unlink(handle, i, iLogsize);
+                mplite_release(handle, i, iLogsize);
+            }
+        }
+    }
+
+    return MPLITE_OK;
+}
+
 MPLITE_API void mplite_print_stats(const mplite_t * const handle,
                                            const mplite_putsfunc_t putsfunc)
 {
     if ((handle != NULL) && (putsfunc != NULL)) {
         char zStats[256];
-        snprintf(zStats, sizeof (zStats), "Total number of calls to malloc: %u",
-                (unsigned) handle->nAlloc);
+        snprintf(zStats, sizeof (zStats), "Total number of calls to malloc: %llu",
+                (unsigned long long) handle->nAlloc);
         putsfunc(zStats);
 
         snprintf(zStats, sizeof (zStats), "Total of all malloc calls - includes "
-                "internal fragmentation: %u", (unsigned) handle->totalAlloc);
+                "internal fragmentation: %llu",
+                (unsigned long long) handle->totalAlloc);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Total internal fragmentation: %u",
-                (unsigned) handle->totalExcess);
+        snprintf(zStats, sizeof (zStats), "Total internal fragmentation: %llu",
+                (unsigned long long) handle->totalExcess);
         putsfunc(zStats);
 
         snprintf(zStats, sizeof (zStats), "Current checkout, including internal "
-                "fragmentation: %u", handle->currentOut);
+                "fragmentation: %llu", (unsigned long long) handle->currentOut);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Current number of distinct checkouts: %u",
-                handle->currentCount);
+        snprintf(zStats, sizeof (zStats), "Current number of distinct checkouts: %llu",
+                (unsigned long long) handle->currentCount);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentOut: %u",
-                handle->maxOut);
+        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentOut: %llu",
+                (unsigned long long) handle->maxOut);
         putsfunc(zStats);
 
-        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentCount: %u",
-                handle->maxCount);
+        snprintf(zStats, sizeof (zStats), "Maximum instantaneous currentCount: %llu",
+                (unsigned long long) handle->maxCount);
         putsfunc(zStats);
 
         snprintf(zStats, sizeof (zStats), "Largest allocation (exclusive of "
-                "internal frag): %u", handle->maxRequest);
+                "internal frag): %llu",
+                (unsigned long long) handle->maxRequest);
         putsfunc(zStats);
     }
 }
@@ -235,95 +468,238 @@ MPLITE_API void mplite_print_stats(const mplite_t * const handle,
  **             mplite_logarithm(8) -> 3
  **             mplite_logarithm(9) -> 4
  */
-static int mplite_logarithm(const int iValue)
+static int mplite_logarithm(const size_t iValue)
 {
     int iLog;
-    for (iLog = 0; (1 << iLog) < iValue; iLog++);
+    for (iLog = 0; ((size_t) 1 << iLog) < iValue; iLog++);
     return iLog;
 }
 
+/*
+ ** Lay out the free block bitmaps for handle->nBlockMax blocks, one after
+ ** the other in handle->aBitmap.  Sizes larger than the pool never have
+ ** free blocks and get no bitmap.  Return their total number of words.
+ */
+static int64_t mplite_layout(mplite_t *handle)
+{
+    int iLogsize; /* Log2 of the size of the blocks of a bitmap */
+    int64_t nSlot; /* Number of bits of a bitmap level */
+    int64_t nWord; /* Number of words of a bitmap level */
+    int64_t nTotal = 0; /* Number of words of all bitmaps so far */
+
+    for (iLogsize = 0; iLogsize <= MPLITE_LOGMAX; iLogsize++) {
+        handle->aiBitmap[iLogsize] = nTotal;
+        if (((int64_t) 1 << iLogsize) > handle->nBlockMax) {
+            continue;
+        }
+        nSlot = mplite_slots(handle, iLogsize);
+        do {
+            nWord = (nSlot + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+            nTotal += nWord;
+            nSlot = nWord;
+        } while (nWord > 1);
+    }
+    return nTotal;
+}
+
+/*
+ ** Clear the words of the free block bitmaps that first cover blocks
+ ** between nOld and nNew once the pool is carved that far, so bitmaps are
+ ** only touched for the carved part of the pool.
+ */
+static void mplite_clear(mplite_t *handle, const int64_t nOld,
+                             const int64_t nNew)
+{
+    int iLogsize; /* Log2 of the size of the blocks of a bitmap */
+    uint64_t *aWord; /* Current bitmap level */
+    int64_t nWord; /* Number of words of the current level */
+    int64_t nFrom; /* Number of words of the level covered so far */
+    int64_t nTo; /* Number of words of the level covered once carved */
+
+    for (iLogsize = 0; iLogsize <= MPLITE_LOGMAX &&
+        ((int64_t) 1 << iLogsize) <= handle->nBlockMax; iLogsize++) {
+        aWord = &handle->aBitmap[handle->aiBitmap[iLogsize]];
+        nWord = mplite_slots(handle, iLogsize);
+        nFrom = nOld > 0 ? ((nOld - 1) >> iLogsize) + 1 : 0;
+        nTo = nNew > 0 ? ((nNew - 1) >> iLogsize) + 1 : 0;
+        do {
+            nWord = (nWord + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+            nFrom = (nFrom + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+            nTo = (nTo + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+            if (nTo > nFrom) {
+                memset(&aWord[nFrom], 0, (nTo - nFrom) * sizeof (uint64_t));
+            }
+            aWord += nWord;
+        } while (nWord > 1);
+    }
+}
+
+/*
+ ** Carve more of the pool into free blocks, at least doubling it and
+ ** making room for an aligned block of size iLogsize.  Blocks of at least
+ ** 1/64th of the pool carve all of it, so they are placed as in a fully
+ ** carved pool rather than splitting the larger blocks at its start.  The
+ ** new blocks are split into the largest aligned chunks that fit and
+ ** released, so they merge with any free buddy at the old end.
+ */
+static void mplite_carve(mplite_t *handle, const int iLogsize)
+{
+    int ii; /* Log2 of the size of a chunk */
+    int64_t nBlock; /* Number of blocks carved afterwards */
+    int64_t nNeed; /* Number of blocks to fit a block of size iLogsize */
+    int64_t iOffset; /* An offset into handle->aCtrl[] */
+
+    nBlock = handle->nBlock * 2;
+    if (nBlock < (int64_t) (MPLITE_CARVE_SIZE / handle->szAtom)) {
+        nBlock = (int64_t) (MPLITE_CARVE_SIZE / handle->szAtom);
+    }
+    nNeed = ((int64_t) 1 << iLogsize);
+    nNeed = ((handle->nBlock + nNeed - 1) & ~(nNeed - 1)) + nNeed;
+    if (nBlock < nNeed) {
+        nBlock = nNeed;
+    }
+    if (((int64_t) 1 << iLogsize) >= handle->nBlockLimit / 64 ||
+        nBlock > handle->nBlockLimit) {
+        nBlock = handle->nBlockLimit;
+    }
+    mplite_clear(handle, handle->nBlock, nBlock);
+
+    /* The chunks show up as checked out until released, so the pool only
+     ** ever holds valid blocks.
+     */
+    for (iOffset = handle->nBlock; iOffset < nBlock;
+        iOffset += ((int64_t) 1 << ii)) {
+        for (ii = MPLITE_LOGMAX; ii > 0; ii--) {
+            if ((iOffset & (((int64_t) 1 << ii) - 1)) == 0 &&
+                (iOffset + ((int64_t) 1 << ii)) <= nBlock) {
+                break;
+            }
+        }
+        handle->aCtrl[iOffset] = (uint8_t) ii;
+    }
+    iOffset = handle->nBlock;
+    handle->nBlock = nBlock;
+    while (iOffset < nBlock) {
+        ii = handle->aCtrl[iOffset] & MPLITE_CTRL_LOGSIZE;
+        mplite_release(handle, iOffset, ii);
+        iOffset += ((int64_t) 1 << ii);
+    }
+}
+
 /*
  ** Return the size of an outstanding allocation, in bytes.  The
  ** size returned omits the 8-byte header overhead.  This only
  ** works for chunks that are currently checked out.
  */
-static int mplite_size(const mplite_t *handle, const void *p)
+static size_t mplite_size(const mplite_t *handle, const void *p)
 {
-    int iSize = 0;
-    if (p) {
-        int i = ((uint8_t *) p - handle->zPool) / handle->szAtom;
+    size_t iSize = 0;
+    int64_t iRun = mplite_run_find(handle, p);
+    if (iRun >= 0) {
+        iSize = mplite_getrun(handle, iRun)->szSlot;
+    }
+    else if (p) {
+        int64_t i = ((uint8_t *) p - handle->zPool) / (int64_t) handle->szAtom;
         assert(i >= 0 && i < handle->nBlock);
-        iSize = handle->szAtom *
-                (1 << (handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE));
+        iSize = handle->szAtom <<
+                (handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE);
     }
     return iSize;
 }
 
 /*
- ** Link the chunk at handle->aPool[i] so that is on the iLogsize
- ** free list.
+ ** Mark the chunk at handle->aPool[i] as free in the iLogsize bitmap,
+ ** and its word as non-zero in the summary levels above it.
  */
-static void mplite_link(mplite_t *handle, const int i,
+static void mplite_link(mplite_t *handle, const int64_t i,
                             const int iLogsize)
 {
-    int x;
+    uint64_t *aWord; /* Current bitmap level */
+    uint64_t w; /* Word of the bit before setting it */
+    int64_t iSlot; /* Bit index in the current level */
+    int64_t nWord; /* Number of words of the current level */
+
     assert(i >= 0 && i < handle->nBlock);
     assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
     assert((handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE) == iLogsize);
 
-    x = mplite_getlink(handle, i)->next = handle->aiFreelist[iLogsize];
-    mplite_getlink(handle, i)->prev = -1;
-    if (x >= 0) {
-        assert(x < handle->nBlock);
-        mplite_getlink(handle, x)->prev = i;
-    }
-    handle->aiFreelist[iLogsize] = i;
+    handle->freeMask |= (uint64_t) 1 << iLogsize;
+    aWord = &handle->aBitmap[handle->aiBitmap[iLogsize]];
+    iSlot = i >> iLogsize;
+    nWord = mplite_slots(handle, iLogsize);
+    do {
+        nWord = (nWord + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+        w = aWord[iSlot / MPLITE_WORD_BITS];
+        aWord[iSlot / MPLITE_WORD_BITS] =
+                w | ((uint64_t) 1 << (iSlot % MPLITE_WORD_BITS));
+        aWord += nWord;
+        iSlot /= MPLITE_WORD_BITS;
+    } while (w == 0 && nWord > 1);
 }
 
 /*
- ** Unlink the chunk at handle->aPool[i] from list it is currently
- ** on.  It should be found on handle->aiFreelist[iLogsize].
+ ** Clear the chunk at handle->aPool[i] in the iLogsize bitmap, and
+ ** its word in the summary levels above it once no bit is left.
  */
-static void mplite_unlink(mplite_t *handle, const int i,
+static void mplite_unlink(mplite_t *handle, const int64_t i,
                               const int iLogsize)
 {
-    int next, prev;
+    uint64_t *aWord; /* Current bitmap level */
+    uint64_t w; /* Word of the bit after clearing it */
+    int64_t iSlot; /* Bit index in the current level */
+    int64_t nWord; /* Number of words of the current level */
+
     assert(i >= 0 && i < handle->nBlock);
     assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
     assert((handle->aCtrl[i] & MPLITE_CTRL_LOGSIZE) == iLogsize);
 
-    next = mplite_getlink(handle, i)->next;
-    prev = mplite_getlink(handle, i)->prev;
-    if (prev < 0) {
-        handle->aiFreelist[iLogsize] = next;
-    }
-    else {
-        mplite_getlink(handle, prev)->next = next;
-    }
-    if (next >= 0) {
-        mplite_getlink(handle, next)->prev = prev;
+    aWord = &handle->aBitmap[handle->aiBitmap[iLogsize]];
+    iSlot = i >> iLogsize;
+    nWord = mplite_slots(handle, iLogsize);
+    do {
+        nWord = (nWord + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+        w = aWord[iSlot / MPLITE_WORD_BITS] &
+                ~((uint64_t) 1 << (iSlot % MPLITE_WORD_BITS));
+        aWord[iSlot / MPLITE_WORD_BITS] = w;
+        aWord += nWord;
+        iSlot /= MPLITE_WORD_BITS;
+    } while (w == 0 && nWord > 1);
+    if (w == 0) {
+        handle->freeMask &= ~((uint64_t) 1 << iLogsize);
     }
 }
 
 /*
- ** Find the first entry on the freelist iLogsize.  Unlink that
- ** entry and return its index.
+ ** Find the lowest free chunk of size iLogsize, descending from the top
+ ** summary word of its bitmap.  Unlink that chunk and return its index.
  */
-static int mplite_unlink_first(mplite_t *handle,
+static int64_t mplite_unlink_first(mplite_t *handle,
                                    const int iLogsize)
 {
-    int i;
-    int iFirst;
+    uint64_t *aLevel[MPLITE_BITMAP_LEVELS]; /* Bitmap levels, bottom up */
+    int nLevel = 0; /* Number of bitmap levels */
+    int64_t nWord; /* Number of words of the current level */
+    int64_t iSlot = 0; /* Bit index in the current level */
 
     assert(iLogsize >= 0 && iLogsize <= MPLITE_LOGMAX);
-    i = iFirst = handle->aiFreelist[iLogsize];
-    assert(iFirst >= 0);
-    while (i > 0) {
-        if (i < iFirst) iFirst = i;
-        i = mplite_getlink(handle, i)->next;
-    }
-    mplite_unlink(handle, iFirst, iLogsize);
-    return iFirst;
+    assert(handle->freeMask & ((uint64_t) 1 << iLogsize));
+    aLevel[0] = &handle->aBitmap[handle->aiBitmap[iLogsize]];
+    nWord = mplite_slots(handle, iLogsize);
+    do {
+        nWord = (nWord + MPLITE_WORD_BITS - 1) / MPLITE_WORD_BITS;
+        assert(nLevel < MPLITE_BITMAP_LEVELS);
+        if (nWord > 1) {
+            aLevel[nLevel + 1] = aLevel[nLevel] + nWord;
+        }
+        nLevel++;
+    } while (nWord > 1);
+    while (nLevel-- > 0) {
+        assert(aLevel[nLevel][iSlot] != 0);
+        iSlot = iSlot * MPLITE_WORD_BITS + mplite_ctz(aLevel[nLevel][iSlot]);
+    }
+    iSlot <<= iLogsize;
+    mplite_unlink(handle, iSlot, iLogsize);
+    return iSlot;
 }
 
 /*
@@ -337,26 +713,32 @@ static int mplite_unlink_first(mplite_t *handle,
  ** threads can be in this routine at the same time.
  */
 static void *mplite_malloc_unsafe(mplite_t *handle,
-                                      const int nByte)
+                                      const size_t nByte)
 {
-    int i; /* Index of a handle->aPool[] slot */
-    int iBin; /* Index into handle->aiFreelist[] */
-    int iFullSz; /* Size of allocation rounded up to power of 2 */
+    int64_t i; /* Index of a handle->aPool[] slot */
+    int iBin; /* Log2 of the size of the block to split */
+    size_t iFullSz; /* Size of allocation rounded up to power of 2 */
     int iLogsize; /* Log2 of iFullSz/POW2_MIN */
 
     /* nByte must be a positive */
     assert(nByte > 0);
 
+    /* Serve small allocations from runs. */
+    if (mplite_is_small(handle, nByte)) {
+        return mplite_run_malloc(handle, nByte);
+    }
+
     /* Keep track of the maximum allocation request.  Even unfulfilled
      ** requests are counted */
-    if ((uint32_t) nByte > handle->maxRequest) {
+    if (nByte > handle->maxRequest) {
         handle->maxRequest = nByte;
     }
 
     /* Abort if the requested allocation size is larger than the largest
-     ** power of two that we can represent using 32-bit signed integers.
+     ** allocation, or the largest block the pool can ever hold.
      */
-    if (nByte > MPLITE_MAX_ALLOC_SIZE) {
+    if (nByte > MPLITE_MAX_ALLOC_SIZE ||
+        ((nByte - 1) >> MPLITE_LOGMAX) >= handle->szAtom) {
         return NULL;
     }
 
@@ -365,24 +747,40 @@ static void *mplite_malloc_unsafe(mplite_t *handle,
         iLogsize++) {
     }
 
-    /* Make sure handle->aiFreelist[iLogsize] contains at least one free
-     ** block.  If not, then split a block of the next larger power of
-     ** two in order to create a new free block of size iLogsize.
+    /* Take the most recently freed block of size iLogsize if there is
+     ** one.  Otherwise take the smallest free block of at least size
+     ** iLogsize, giving back empty runs and merging the quick lists and
+     ** then carving more of the pool first if there is none, and split it
+     ** down to size iLogsize.
      */
-    for (iBin = iLogsize; handle->aiFreelist[iBin] < 0 && iBin <= MPLITE_LOGMAX;
-        iBin++) {
-    }
-    if (iBin > MPLITE_LOGMAX) {
-        return NULL;
+    if (iLogsize < MPLITE_QUICK_ORDERS && handle->nQuick[iLogsize] > 0) {
+        i = handle->aiQuick[iLogsize][--handle->nQuick[iLogsize]];
+        assert(handle->aCtrl[i] == (MPLITE_CTRL_QUICK | iLogsize));
     }
-    i = mplite_unlink_first(handle, iBin);
-    while (iBin > iLogsize) {
-        int newSize;
-
-        iBin--;
-        newSize = 1 << iBin;
-        handle->aCtrl[i + newSize] = (uint8_t) (MPLITE_CTRL_FREE | iBin);
-        mplite_link(handle, i + newSize, iBin);
+    else {
+        if ((handle->freeMask >> iLogsize) == 0) {
+            mplite_run_reclaim(handle);
+            for (iBin = 0; iBin < MPLITE_QUICK_ORDERS; iBin++) {
+                mplite_flush(handle, iBin);
+            }
+            while ((handle->freeMask >> iLogsize) == 0 &&
+                handle->nBlock < handle->nBlockLimit) {
+                mplite_carve(handle, iLogsize);
+            }
+            if ((handle->freeMask >> iLogsize) == 0) {
+                return NULL;
+            }
+        }
+        iBin = iLogsize + mplite_ctz(handle->freeMask >> iLogsize);
+        i = mplite_unlink_first(handle, iBin);
+        while (iBin > iLogsize) {
+            int64_t newSize;
+
+            iBin--;
+            newSize = (int64_t) 1 << iBin;
+            handle->aCtrl[i + newSize] = (uint8_t) (MPLITE_CTRL_FREE | iBin);
+            mplite_link(handle, i + newSize, iBin);
+        }
     }
     handle->aCtrl[i] = (uint8_t) iLogsize;
 
@@ -409,22 +807,29 @@ static void *mplite_malloc_unsafe(mplite_t *handle,
 static void mplite_free_unsafe(mplite_t *handle,
                                    const void *pOld)
 {
-    uint32_t size, iLogsize;
-    int iBlock;
+    int64_t size, iBlock;
+    int iLogsize;
+
+    /* Slots go back to their run. */
+    iBlock = mplite_run_find(handle, pOld);
+    if (iBlock >= 0) {
+        mplite_run_free(handle, iBlock, pOld);
+        return;
+    }
 
     /* Set iBlock to the index of the block pointed to by pOld in
      ** the array of handle->szAtom byte blocks pointed to by handle->zPool.
      */
-    iBlock = ((uint8_t *) pOld - handle->zPool) / handle->szAtom;
+    iBlock = ((uint8_t *) pOld - handle->zPool) / (int64_t) handle->szAtom;
 
     /* Check that the pointer pOld points to a valid, non-free block. */
     assert(iBlock >= 0 && iBlock < handle->nBlock);
-    assert(((uint8_t *) pOld - handle->zPool) % handle->szAtom == 0);
+    assert(((uint8_t *) pOld - handle->zPool) % (int64_t) handle->szAtom == 0);
     assert((handle->aCtrl[iBlock] & MPLITE_CTRL_FREE) == 0);
 
     iLogsize = handle->aCtrl[iBlock] & MPLITE_CTRL_LOGSIZE;
-    size = 1 << iLogsize;
-    assert(iBlock + size - 1 < (uint32_t) handle->nBlock);
+    size = (int64_t) 1 << iLogsize;
+    assert(iBlock + size - 1 < handle->nBlock);
 
     handle->aCtrl[iBlock] |= MPLITE_CTRL_FREE;
     handle->aCtrl[iBlock + size - 1] |= MPLITE_CTRL_FREE;
@@ -435,9 +840,54 @@ static void mplite_free_unsafe(mplite_t *handle,
     assert(handle->currentOut > 0 || handle->currentCount == 0);
     assert(handle->currentCount > 0 || handle->currentOut == 0);
 
+    mplite_defer(handle, iBlock, iLogsize);
+}
+
+/*
+ ** Put the freed block at iBlock on the quick list of its size, merging
+ ** that list first if it is full.  Large blocks are released right away.
+ */
+static void mplite_defer(mplite_t *handle, int64_t iBlock, int iLogsize)
+{
+    if (iLogsize >= MPLITE_QUICK_ORDERS) {
+        mplite_release(handle, iBlock, iLogsize);
+        return;
+    }
+    /* Mark the block first, so merging the full list leaves it alone. */
+    handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_QUICK | iLogsize);
+    if (handle->nQuick[iLogsize] == MPLITE_QUICK_SIZE) {
+        mplite_flush(handle, iLogsize);
+    }
+    handle->aiQuick[iLogsize][handle->nQuick[iLogsize]++] = iBlock;
+}
+
+/*
+ ** Release all blocks on the quick list of size iLogsize, merging them
+ ** with their free buddies.
+ */
+static void mplite_flush(mplite_t *handle, const int iLogsize)
+{
+    int64_t iBlock;
+
+    while (handle->nQuick[iLogsize] > 0) {
+        iBlock = handle->aiQuick[iLogsize][--handle->nQuick[iLogsize]];
+        assert(handle->aCtrl[iBlock] == (MPLITE_CTRL_QUICK | iLogsize));
+        mplite_release(handle, iBlock, iLogsize);
+    }
+}
+
+/*
+ ** Return the block at iBlock to the free lists, merging it with its
+ ** buddies for as long as they are free as well.
+ */
+static void mplite_release(mplite_t *handle, int64_t iBlock,
+                               int iLogsize)
+{
+    int64_t size = (int64_t) 1 << iLogsize;
+
     handle->aCtrl[iBlock] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
     while (iLogsize < MPLITE_LOGMAX) {
-        int iBuddy;
+        int64_t iBuddy;
         if ((iBlock >> iLogsize) & 1) {
             iBuddy = iBlock - size;
         }
@@ -445,7 +895,7 @@ static void mplite_free_unsafe(mplite_t *handle,
             iBuddy = iBlock + size;
         }
         assert(iBuddy >= 0);
-        if ((iBuddy + (1 << iLogsize)) > handle->nBlock) break;
+        if ((iBuddy + size) > handle->nBlock) break;
         if (handle->aCtrl[iBuddy] != (MPLITE_CTRL_FREE | iLogsize)) break;
         mplite_unlink(handle, iBuddy, iLogsize);
         iLogsize++;
@@ -462,3 +912,183 @@ static void mplite_free_unsafe(mplite_t *handle,
     }
     mplite_link(handle, iBlock, iLogsize);
 }
+
+/*
+ ** Put the run at handle->aPool[iRun] on the list of runs with free slots
+ ** of its size.
+ */
+static void mplite_run_link(mplite_t *handle, const int64_t iRun)
+{
+    mplite_run_t *pRun = mplite_getrun(handle, iRun);
+    int c = (int) (pRun->szSlot / handle->szSlot) - 1;
+
+    assert(c >= 0 && c < MPLITE_RUN_CLASSES);
+    pRun->prev = -1;
+    pRun->next = handle->aiRun[c];
+    if (pRun->next >= 0) {
+        mplite_getrun(handle, pRun->next)->prev = iRun;
+    }
+    handle->aiRun[c] = iRun;
+}
+
+/*
+ ** Take the run at handle->aPool[iRun] off the list of runs with free
+ ** slots of its size.
+ */
+static void mplite_run_unlink(mplite_t *handle, const int64_t iRun)
+{
+    mplite_run_t *pRun = mplite_getrun(handle, iRun);
+    int c = (int) (pRun->szSlot / handle->szSlot) - 1;
+
+    assert(c >= 0 && c < MPLITE_RUN_CLASSES);
+    if (pRun->prev < 0) {
+        handle->aiRun[c] = pRun->next;
+    }
+    else {
+        mplite_getrun(handle, pRun->prev)->next = pRun->next;
+    }
+    if (pRun->next >= 0) {
+        mplite_getrun(handle, pRun->next)->prev = pRun->prev;
+    }
+    pRun->next = pRun->prev = -1;
+}
+
+/*
+ ** Return the index of the run p is a slot of, or -1 if p is a block.  Runs
+ ** are aligned blocks, so only the block p would lie in if it were a slot
+ ** needs checking.  That block starts a run, or p is no valid pointer.
+ */
+static int64_t mplite_run_find(const mplite_t *handle, const void *p)
+{
+    int64_t iRun;
+
+    if (!handle->szSlot || !p) {
+        return -1;
+    }
+    iRun = (((uint8_t *) p - handle->zPool) / (int64_t) handle->szAtom) &
+            ~(mplite_run_blocks(handle) - 1);
+    if ((uint8_t *) p == (uint8_t *) mplite_getrun(handle, iRun) ||
+        (handle->aCtrl[iRun] & (MPLITE_CTRL_FREE | MPLITE_CTRL_RUN)) !=
+        MPLITE_CTRL_RUN) {
+        return -1;
+    }
+    return iRun;
+}
+
+/*
+ ** Return a slot of at least nByte bytes from a run, carving a new run
+ ** out of the pool if no run of that size has free slots.
+ */
+static void *mplite_run_malloc(mplite_t *handle, const size_t nByte)
+{
+    int c = (int) ((nByte - 1) / handle->szSlot); /* Slot size class */
+    size_t szSlot = (c + 1) * handle->szSlot; /* Slot size in bytes */
+    int64_t iRun = handle->aiRun[c]; /* Run to take a slot from */
+    mplite_run_t *pRun; /* Header of that run */
+    int ii; /* Loop counter */
+    int iSlot; /* Slot taken */
+
+    /* Empty runs are not checked out, count this one again. */
+    if (iRun >= 0 && mplite_getrun(handle, iRun)->nFree ==
+        (uint32_t) mplite_run_slots(szSlot)) {
+        handle->currentCount++;
+        handle->currentOut += MPLITE_RUN_SIZE;
+    }
+    else if (iRun < 0) {
+        pRun = (mplite_run_t *) mplite_malloc_unsafe(handle,
+                MPLITE_RUN_SIZE);
+        if (!pRun) {
+            return NULL;
+        }
+        iRun = ((uint8_t *) pRun - handle->zPool) / (int64_t) handle->szAtom;
+        memset(pRun->aFree, 0, sizeof (pRun->aFree));
+        for (ii = 0; ii < mplite_run_slots(szSlot); ii++) {
+            pRun->aFree[ii / MPLITE_WORD_BITS] |=
+                    (uint64_t) 1 << (ii % MPLITE_WORD_BITS);
+        }
+        pRun->szSlot = (uint32_t) szSlot;
+        pRun->nFree = mplite_run_slots(szSlot);
+        handle->aCtrl[iRun] |= MPLITE_CTRL_RUN;
+        mplite_run_link(handle, iRun);
+    }
+    pRun = mplite_getrun(handle, iRun);
+    assert(pRun->szSlot == szSlot && pRun->nFree > 0);
+
+    for (ii = 0; pRun->aFree[ii] == 0; ii++);
+    iSlot = ii * MPLITE_WORD_BITS + mplite_ctz(pRun->aFree[ii]);
+    pRun->aFree[ii] &= pRun->aFree[ii] - 1;
+    if (--pRun->nFree == 0) {
+        mplite_run_unlink(handle, iRun);
+    }
+
+    return (uint8_t *) pRun + MPLITE_RUN_HDR + iSlot * szSlot;
+}
+
+/*
+ ** Return the slot pOld to the run at handle->aPool[iRun].  A run that
+ ** becomes empty goes back to the pool, unless it is the only one of its
+ ** size with free slots.  That one stays until the pool runs dry, but no
+ ** longer counts as checked out.
+ */
+static void mplite_run_free(mplite_t *handle, const int64_t iRun,
+                                const void *pOld)
+{
+    mplite_run_t *pRun = mplite_getrun(handle, iRun);
+    size_t iOffset = (uint8_t *) pOld - (uint8_t *) pRun - MPLITE_RUN_HDR;
+    int iSlot = (int) (iOffset / pRun->szSlot);
+
+    assert(iOffset % pRun->szSlot == 0);
+    assert(iSlot < mplite_run_slots(pRun->szSlot));
+    assert(!(pRun->aFree[iSlot / MPLITE_WORD_BITS] &
+            ((uint64_t) 1 << (iSlot % MPLITE_WORD_BITS))));
+
+    pRun->aFree[iSlot / MPLITE_WORD_BITS] |=
+            (uint64_t) 1 << (iSlot % MPLITE_WORD_BITS);
+    if (++pRun->nFree == 1) {
+        mplite_run_link(handle, iRun);
+    }
+    else if (pRun->nFree == (uint32_t) mplite_run_slots(pRun->szSlot) &&
+        (pRun->next >= 0 || pRun->prev >= 0)) {
+        mplite_run_unlink(handle, iRun);
+        handle->aCtrl[iRun] &= ~MPLITE_CTRL_RUN;
+        mplite_free_unsafe(handle, pRun);
+    }
+    else if (pRun->nFree == (uint32_t) mplite_run_slots(pRun->szSlot)) {
+        assert(handle->currentCount > 0);
+        assert(handle->currentOut >= MPLITE_RUN_SIZE);
+        handle->currentCount--;
+        handle->currentOut -= MPLITE_RUN_SIZE;
+    }
+}
+
+/*
+ ** Give the empty runs kept for reuse back to the pool, so they do not
+ ** split the blocks around them for good.  They are no longer counted as
+ ** checked out, and go on the quick lists like any other freed block.
+ */
+static void mplite_run_reclaim(mplite_t *handle)
+{
+    mplite_run_t *pRun; /* Header of the run at iRun */
+    int64_t iRun, iNext; /* Run to look at, and the one after it */
+    int iLogsize; /* Log2 of the number of blocks of a run */
+    int c; /* Slot size class */
+
+    if (!handle->szSlot) {
+        return;
+    }
+    for (c = 0; c < MPLITE_RUN_CLASSES; c++) {
+        for (iRun = handle->aiRun[c]; iRun >= 0; iRun = iNext) {
+            pRun = mplite_getrun(handle, iRun);
+            iNext = pRun->next;
+            if (pRun->nFree != (uint32_t) mplite_run_slots(pRun->szSlot)) {
+                continue;
+            }
+            mplite_run_unlink(handle, iRun);
+            iLogsize = handle->aCtrl[iRun] & MPLITE_CTRL_LOGSIZE;
+            handle->aCtrl[iRun] = (uint8_t) (MPLITE_CTRL_FREE | iLogsize);
+            handle->aCtrl[iRun + mplite_run_blocks(handle) - 1] |=
+                    MPLITE_CTRL_FREE;
+            mplite_defer(handle, iRun, iLogsize);
+        }
+    }
+}
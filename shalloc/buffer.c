@@ -5,7 +5,7 @@
 /* Allocator function definitions. */
 shalloc_buff_op_t shalloc_space_buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES] = {
     /* SHALLOC_BUFF_ALLOC_TYPE_NONE */
-    { 0, 0, 0, 0, 0 },
+    { 0, 0, 0, 0, 0, 0, 0 },
 
     /* SHALLOC_BUFF_ALLOC_TYPE_BUFFER */
     {
@@ -13,7 +13,9 @@ shalloc_buff_op_t shalloc_space_buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES] = {
         gen_empty_destroy,
         _buffer_malloc,
         _buffer_free,
-        gen_memset_calloc
+        gen_memset_calloc,
+        NULL,
+        _buffer_repair
     },
 
     /* SHALLOC_BUFF_ALLOC_TYPE_SIMPLE */
@@ -22,7 +24,9 @@ shalloc_buff_op_t shalloc_space_buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES] = {
         gen_empty_destroy,
         _simple_malloc,
         _simple_free,
-        gen_memset_calloc
+        gen_memset_calloc,
+        gen_empty_extend,
+        NULL
     },
 
     /* SHALLOC_BUFF_ALLOC_TYPE_MPLITE */
@@ -31,7 +35,9 @@ shalloc_buff_op_t shalloc_space_buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES] = {
         gen_empty_destroy,
         _mplite_malloc,
         _mplite_free,
-        gen_memset_calloc
+        gen_memset_calloc,
+        _mplite_extend,
+        _mplite_repair
     },
 
     /* SHALLOC_BUFF_ALLOC_TYPE_NOFREE */
@@ -41,6 +47,8 @@ shalloc_buff_op_t shalloc_space_buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES] = {
         _nofree_malloc,
         _nofree_free,
         gen_memset_calloc,
+        gen_empty_extend,
+        _nofree_repair
     },
 
     /* SHALLOC_BUFF_ALLOC_TYPE_SLAB */
@@ -49,7 +57,9 @@ shalloc_buff_op_t shalloc_space_buff_ops[__NUM_SHALLOC_BUFF_ALLOC_TYPES] = {
         _slab_destroy,
         _slab_malloc,
         _slab_free,
-        gen_memset_calloc
+        gen_memset_calloc,
+        NULL,
+        _slab_repair
     }
 };
 
@@ -66,6 +76,7 @@ shalloc_buff_t* shalloc_get_buff(shalloc_buff_t *buff,
     buff->start = start;
     buff->end = (char*)start + size - 1;
     buff->size = size;
+    buff->max_size = size;
     buff->unused_size = size;
     buff->block_size = block_size;
     if (!type) {
@@ -97,3 +108,12 @@ void shalloc_buff_reset(shalloc_buff_t *buff)
     ret = buff->op->create(buff);
     assert(ret >= 0 && "Corrupted buffer?");
 }
+
+int shalloc_buff_get_usage(shalloc_buff_t *buff, shalloc_usage_t *usage)
+{
+    shalloc_heap_t *heap = shalloc_ptr_to_heap(buff->start);
+
+    memset(usage, 0, sizeof(shalloc_usage_t));
+    return shalloc_usage_add(buff->start, buff->size,
+        heap && (heap->mmap_flags & SHALLOC_MAP_FILE), usage);
+}
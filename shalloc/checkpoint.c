@@ -0,0 +1,615 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+/*
+ * Whole-space checkpoints. A checkpoint directory holds a manifest and one
+ * sparse file per segment: the committed private heap, the control pages
+ * with the inherit heap table, the pointer map and the committed data of
+ * every heap. Restore maps the segments back at their original addresses
+ * MAP_PRIVATE, so it copies nothing and processes forked from a restored
+ * space share all clean pages. Shared segments (the control pages and
+ * inherit heaps) are copied into new shared memory instead, so they can
+ * still be inherited across exec().
+ *
+ * Segment files are named after their address. A new checkpoint replaces
+ * them (and the manifest last) by renaming new files over the old ones,
+ * so processes restored from the directory keep their mappings. When the
+ * directory holds the previous checkpoint of this space, the new segments
+ * of SHALLOC_MAP_TRACK_DIRTY heaps are copies (or reflinks) of the old
+ * ones with only the pages written since applied.
+ *
+ * File heaps persist on their own and are not copied. Their segment file
+ * holds the path of the heap file instead, which restore maps back with
+ * its contents at that time, not at checkpoint time.
+ */
+#define SHALLOC_CKPT_MAGIC          0x5348434b
+#define SHALLOC_CKPT_VERSION        10
+#define SHALLOC_CKPT_MANIFEST       "manifest"
+#define SHALLOC_CKPT_SEG_FMT        "seg.%lx"
+#define SHALLOC_CKPT_TMP_SUFFIX     ".tmp"
+#define SHALLOC_CKPT_BATCH_SIZE     (16*SHALLOC_PAGE_SIZE)
+#define SHALLOC_CKPT_DIRTY_RANGES   64
+
+enum shalloc_ckpt_seg_type {
+    SHALLOC_CKPT_SEG_PRIVATE = 0,
+    SHALLOC_CKPT_SEG_CONTROL,
+    SHALLOC_CKPT_SEG_HEAP,
+    SHALLOC_CKPT_SEG_INHERIT_HEAP,
+    SHALLOC_CKPT_SEG_FILE_HEAP
+};
+
+typedef struct {
+    void *addr;
+    size_t size;
+    int type;
+} shalloc_ckpt_seg_t;
+
+typedef struct {
+    unsigned magic;
+    unsigned version;
+    uint64_t id;
+    void *base_addr;
+    size_t base_size;
+    shalloc_space_t *space;
+    int num_segs;
+} shalloc_ckpt_header_t;
+
+/* Checkpoint utility functions. */
+static void shalloc_ckpt_path(char *path, const char *dir, void *addr,
+    int tmp)
+{
+    int len;
+
+    if (!addr) {
+        len = snprintf(path, PATH_MAX, "%s/%s", dir, SHALLOC_CKPT_MANIFEST);
+    }
+    else {
+        len = snprintf(path, PATH_MAX, "%s/" SHALLOC_CKPT_SEG_FMT, dir,
+            (unsigned long) addr);
+    }
+    if (tmp && len < PATH_MAX) {
+        snprintf(path + len, PATH_MAX - len, "%s", SHALLOC_CKPT_TMP_SUFFIX);
+    }
+}
+
+static uint64_t shalloc_ckpt_new_id()
+{
+    static uint64_t counter;
+    struct timespec ts;
+    uint64_t id;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    id = ((uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec)
+        ^ ((uint64_t) getpid() << 40) ^ ++counter;
+    return id ? id : 1;
+}
+
+static int shalloc_ckpt_is_seg(void *addr)
+{
+    shalloc_heap_t *heap;
+
+    if (addr == shalloc_heap_to_buff(shalloc_space->priv_heap)->start
+        || addr == shalloc_space->magic_control_page
+        || addr == (void*) shalloc_space->ptr_map) {
+        return 1;
+    }
+    heap = shalloc_ptr_to_heap(addr);
+    return heap && shalloc_heap_to_buff(heap)->start == addr;
+}
+
+static int shalloc_ckpt_is_zero(const char *page)
+{
+    return page[0] == 0 && !memcmp(page, page + 1, SHALLOC_PAGE_SIZE - 1);
+}
+
+static ssize_t shalloc_ckpt_read(char *buff, char *addr, size_t size)
+{
+    struct iovec local = { buff, size }, remote = { addr, size };
+    ssize_t ret;
+
+    /*
+     * Guard pages inside heaps are inaccessible, so read through the
+     * kernel, which stops at the first one instead of faulting.
+     */
+    ret = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+    if (ret < 0 && errno == EFAULT) {
+        return 0;
+    }
+    if (ret < 0) {
+        memcpy(buff, addr, size);
+        return size;
+    }
+    return ret - ret % SHALLOC_PAGE_SIZE;
+}
+
+static int shalloc_ckpt_write_seg(int fd, char *addr, size_t size)
+{
+    char buff[SHALLOC_CKPT_BATCH_SIZE];
+    size_t offset, len, i;
+    ssize_t ret;
+
+    /* Zero and unreadable pages are left as holes. */
+    if (ftruncate(fd, size) < 0) {
+        return -1;
+    }
+    for (offset = 0; offset < size; ) {
+        len = size - offset < sizeof(buff) ? size - offset : sizeof(buff);
+        ret = shalloc_ckpt_read(buff, addr + offset, len);
+        for (i = 0; i < (size_t) ret; i += SHALLOC_PAGE_SIZE) {
+            if (shalloc_ckpt_is_zero(buff + i)) {
+                continue;
+            }
+            if (pwrite(fd, buff + i, SHALLOC_PAGE_SIZE, offset + i)
+                != (ssize_t) SHALLOC_PAGE_SIZE) {
+                return -1;
+            }
+        }
+        offset += ret < (ssize_t) len ? ret + SHALLOC_PAGE_SIZE : len;
+    }
+    return 0;
+}
+
+static int shalloc_ckpt_copy_seg(int fd, int old_fd)
+{
+    off_t data, hole, end;
+    loff_t in, out;
+    ssize_t ret;
+
+    /* Share the blocks of the old segment where the file system can. */
+    if (ioctl(fd, FICLONE, old_fd) == 0) {
+        return 0;
+    }
+    end = lseek(old_fd, 0, SEEK_END);
+    if (end < 0 || ftruncate(fd, end) < 0) {
+        return -1;
+    }
+    for (data = 0; (data = lseek(old_fd, data, SEEK_DATA)) >= 0;
+        data = hole) {
+        hole = lseek(old_fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return -1;
+        }
+        for (in = out = data; in < hole; ) {
+            ret = copy_file_range(old_fd, &in, fd, &out, hole - in, 0);
+            if (ret <= 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int shalloc_ckpt_write_dirty(int fd, char *addr, size_t size)
+{
+    shalloc_range_t ranges[SHALLOC_CKPT_DIRTY_RANGES];
+    char buff[SHALLOC_CKPT_BATCH_SIZE];
+    char *start, *end = addr + size;
+    void *next;
+    size_t offset, range_end, len;
+    ssize_t ret;
+    int i, num_ranges;
+
+    /* Overwrite written pages, zero or not. */
+    if (ftruncate(fd, size) < 0) {
+        return -1;
+    }
+    for (start = addr; start < end; start = (char*) next) {
+        num_ranges = shalloc_dirty_scan(start, end - start, ranges,
+            SHALLOC_CKPT_DIRTY_RANGES, &next);
+        if (num_ranges < 0 || (char*) next <= start) {
+            return -1;
+        }
+        for (i = 0; i < num_ranges; i++) {
+            offset = ranges[i].start - addr;
+            range_end = offset + ranges[i].size;
+            while (offset < range_end) {
+                len = range_end - offset < sizeof(buff) ?
+                    range_end - offset : sizeof(buff);
+                ret = shalloc_ckpt_read(buff, addr + offset, len);
+                if (ret > 0 && pwrite(fd, buff, ret, offset) != ret) {
+                    return -1;
+                }
+                offset += ret < (ssize_t) len ? ret + SHALLOC_PAGE_SIZE : len;
+            }
+        }
+    }
+    return 0;
+}
+
+static int shalloc_ckpt_write_path(int fd, shalloc_heap_t *heap)
+{
+    char link[64], path[PATH_MAX];
+    struct stat st;
+    ssize_t len;
+
+    /* Heap files unlinked since cannot be reopened. */
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", heap->inherit_id);
+    len = readlink(link, path, sizeof(path));
+    if (len <= 0 || len == sizeof(path) || fstat(heap->inherit_id, &st) < 0
+        || st.st_nlink == 0) {
+        return -1;
+    }
+    if (shalloc_heap_sync(heap) < 0 || write(fd, path, len) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+static int shalloc_ckpt_add_seg(const char *dir, int manifest_fd,
+    int *num_segs, void *addr, size_t size, int type, int track,
+    int incremental)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    shalloc_ckpt_seg_t seg;
+    int fd, old_fd, ret = -1;
+
+    /*
+     * Build the new segment from the old one and the pages written since,
+     * leaving the old file untouched for processes restored from it.
+     */
+    shalloc_ckpt_path(path, dir, addr, 0);
+    shalloc_ckpt_path(tmp_path, dir, addr, 1);
+    if (incremental && (old_fd = open(path, O_RDONLY)) >= 0) {
+        fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (fd >= 0) {
+            ret = shalloc_ckpt_copy_seg(fd, old_fd);
+            ret = ret < 0 ? ret : shalloc_ckpt_write_dirty(fd, addr, size);
+            if (close(fd) < 0 || (ret == 0 && rename(tmp_path, path) < 0)) {
+                ret = -1;
+            }
+        }
+        close(old_fd);
+    }
+
+    /* Otherwise write the segment in full, tracking writes from now on. */
+    if (ret < 0) {
+        if (track) {
+            shalloc_dirty_reset(addr, size);
+        }
+        fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+        if (fd < 0) {
+            return -1;
+        }
+        ret = type == SHALLOC_CKPT_SEG_FILE_HEAP ?
+            shalloc_ckpt_write_path(fd, shalloc_ptr_to_heap(addr)) :
+            shalloc_ckpt_write_seg(fd, addr, size);
+        if (close(fd) < 0 || (ret == 0 && rename(tmp_path, path) < 0)) {
+            ret = -1;
+        }
+        if (ret < 0) {
+            unlink(tmp_path);
+            return -1;
+        }
+    }
+    seg.addr = addr;
+    seg.size = size;
+    seg.type = type;
+    if (write(manifest_fd, &seg, sizeof(seg)) != sizeof(seg)) {
+        return -1;
+    }
+    (*num_segs)++;
+    return 0;
+}
+
+static int shalloc_ckpt_load_seg(int fd, shalloc_ckpt_seg_t *seg,
+    int mmap_flags)
+{
+    off_t data, hole;
+    int shm_fd;
+
+    if (seg->type == SHALLOC_CKPT_SEG_PRIVATE
+        || seg->type == SHALLOC_CKPT_SEG_HEAP) {
+        return mmap(seg->addr, seg->size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_FIXED, fd, 0) == seg->addr ? 0 : -1;
+    }
+
+    /* Copy shared segments into new shared memory, skipping holes. */
+    shm_fd = shalloc_shm_create(seg->size, mmap_flags);
+    if (shm_fd < 0) {
+        return -1;
+    }
+    if (shalloc_shm_map(shm_fd, seg->addr, seg->size, 0,
+        PROT_READ|PROT_WRITE) < 0) {
+        shalloc_shm_close(shm_fd);
+        return -1;
+    }
+    for (data = 0; (data = lseek(fd, data, SEEK_DATA)) >= 0; data = hole) {
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || pread(fd, (char*) seg->addr + data, hole - data,
+            data) != hole - data) {
+            shalloc_shm_close(shm_fd);
+            return -1;
+        }
+    }
+    return shm_fd;
+}
+
+static int shalloc_ckpt_load_path(int fd, shalloc_heap_t *heap)
+{
+    char path[PATH_MAX];
+    ssize_t len;
+
+    len = read(fd, path, sizeof(path) - 1);
+    if (len <= 0) {
+        return -1;
+    }
+    path[len] = '\0';
+    return shalloc_heap_reopen(heap, path);
+}
+
+/* Shalloc checkpoint interface. */
+int shalloc_space_checkpoint(const char *dir)
+{
+    shalloc_ckpt_header_t header, old_header;
+    shalloc_ckpt_seg_t seg;
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    shalloc_buff_t *data;
+    shalloc_heap_t *heap;
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    int fd, old_fd, ret, type, track, incremental;
+
+    assert(shalloc_space && "shalloc_space not initialized");
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    /* Tracked heaps only need their pages written since the last one. */
+    shalloc_ckpt_path(path, dir, NULL, 0);
+    old_fd = open(path, O_RDONLY);
+    if (old_fd >= 0 && (read(old_fd, &old_header, sizeof(old_header))
+        != sizeof(old_header) || old_header.magic != SHALLOC_CKPT_MAGIC
+        || old_header.version != SHALLOC_CKPT_VERSION)) {
+        close(old_fd);
+        old_fd = -1;
+    }
+    incremental = old_fd >= 0 && shalloc_space->ckpt_id != 0
+        && old_header.id == shalloc_space->ckpt_id;
+    shalloc_space->ckpt_id = shalloc_ckpt_new_id();
+
+    shalloc_ckpt_path(tmp_path, dir, NULL, 1);
+    fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+        if (old_fd >= 0) {
+            close(old_fd);
+        }
+        return -1;
+    }
+
+    /* Leave room for the header, written last. */
+    memset(&header, 0, sizeof(header));
+    ret = write(fd, &header, sizeof(header)) == sizeof(header) ? 0 : -1;
+    data = shalloc_heap_to_buff(shalloc_space->priv_heap);
+    ret = ret < 0 ? ret : shalloc_ckpt_add_seg(dir, fd, &header.num_segs,
+        data->start, data->size, SHALLOC_CKPT_SEG_PRIVATE, 0, 0);
+    ret = ret < 0 ? ret : shalloc_ckpt_add_seg(dir, fd, &header.num_segs,
+        magic_info, SHALLOC_MAGIC_PAGES_SIZE + magic_info->table_size,
+        SHALLOC_CKPT_SEG_CONTROL, 0, 0);
+    ret = ret < 0 ? ret : shalloc_ckpt_add_seg(dir, fd, &header.num_segs,
+        shalloc_space->ptr_map, SHALLOC_PTRMAP_SIZE(shalloc_space->base.size),
+        SHALLOC_CKPT_SEG_PRIVATE, 0, 0);
+    for (heap = shalloc_space_next_heap(NULL); heap && ret == 0;
+        heap = shalloc_space_next_heap(heap)) {
+        /* File heaps persist on their own, only record their path. */
+        if (heap->mmap_flags & SHALLOC_MAP_FILE) {
+            type = SHALLOC_CKPT_SEG_FILE_HEAP;
+        }
+        else if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
+            type = SHALLOC_CKPT_SEG_INHERIT_HEAP;
+        }
+        else {
+            type = SHALLOC_CKPT_SEG_HEAP;
+        }
+        track = type == SHALLOC_CKPT_SEG_HEAP && (heap->mmap_flags
+            & SHALLOC_MAP_TRACK_DIRTY);
+        data = shalloc_heap_to_buff(heap);
+        ret = shalloc_ckpt_add_seg(dir, fd, &header.num_segs, data->start,
+            data->size, type, track, track && incremental);
+    }
+
+    header.magic = SHALLOC_CKPT_MAGIC;
+    header.version = SHALLOC_CKPT_VERSION;
+    header.id = shalloc_space->ckpt_id;
+    header.base_addr = shalloc_space->base.start;
+    header.base_size = shalloc_space->base.size;
+    header.space = shalloc_space;
+    if (ret == 0
+        && pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        ret = -1;
+    }
+    if (close(fd) < 0 || (ret == 0 && rename(tmp_path, path) < 0)) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        unlink(tmp_path);
+    }
+
+    /* Drop the segments of heaps destroyed since the last checkpoint. */
+    if (old_fd >= 0) {
+        while (ret == 0 && read(old_fd, &seg, sizeof(seg)) == sizeof(seg)) {
+            if (!shalloc_ckpt_is_seg(seg.addr)) {
+                shalloc_ckpt_path(path, dir, seg.addr, 0);
+                unlink(path);
+            }
+        }
+        close(old_fd);
+    }
+    return ret;
+}
+
+int shalloc_space_restore(const char *dir)
+{
+    shalloc_ckpt_header_t header;
+    shalloc_ckpt_seg_t seg;
+    shalloc_magic_t *magic_info = NULL;
+    shalloc_heap_t *heap;
+    char path[PATH_MAX];
+    char *base_addr;
+    int fd, seg_fd, ret, i, j;
+
+    if (shalloc_space) {
+        return -1;
+    }
+    shalloc_ckpt_path(path, dir, NULL, 0);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header)
+        || header.magic != SHALLOC_CKPT_MAGIC
+        || header.version != SHALLOC_CKPT_VERSION) {
+        close(fd);
+        return -1;
+    }
+    base_addr = shalloc_space_reserve(header.base_addr, header.base_size);
+    if (base_addr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    /*
+     * Segments come in dependency order: the private heap (with the space
+     * itself), the control pages, the pointer map and then the heaps.
+     */
+    for (i = 0, ret = 0; i < header.num_segs; i++) {
+        if (read(fd, &seg, sizeof(seg)) != sizeof(seg)
+            || (char*) seg.addr < base_addr
+            || (char*) seg.addr + seg.size > base_addr + header.base_size) {
+            ret = -1;
+            break;
+        }
+        heap = NULL;
+        if (seg.type == SHALLOC_CKPT_SEG_HEAP
+            || seg.type == SHALLOC_CKPT_SEG_INHERIT_HEAP
+            || seg.type == SHALLOC_CKPT_SEG_FILE_HEAP) {
+            heap = magic_info ? shalloc_ptr_to_heap(seg.addr) : NULL;
+            if (!heap) {
+                ret = -1;
+                break;
+            }
+        }
+        shalloc_ckpt_path(path, dir, seg.addr, 0);
+        seg_fd = open(path, O_RDONLY);
+        if (seg_fd < 0) {
+            ret = -1;
+            break;
+        }
+        if (seg.type == SHALLOC_CKPT_SEG_FILE_HEAP) {
+            ret = shalloc_ckpt_load_path(seg_fd, heap);
+        }
+        else {
+            ret = shalloc_ckpt_load_seg(seg_fd, &seg,
+                heap ? heap->mmap_flags : 0);
+        }
+        close(seg_fd);
+        if (ret < 0) {
+            break;
+        }
+        switch (seg.type) {
+        case SHALLOC_CKPT_SEG_PRIVATE:
+            shalloc_space = header.space;
+            break;
+        case SHALLOC_CKPT_SEG_CONTROL:
+            /*
+             * Shared memory ids and heap lock owners of the checkpointed
+             * process are stale and the restored space is not named. The
+             * rest of the table range is mapped as in any other process.
+             */
+            if (shalloc_shm_resize(ret, SHALLOC_MAGIC_PAGES_SIZE
+                + SHALLOC_INHERIT_TABLE_MAX_SIZE) < 0
+                || shalloc_shm_map(ret, (char*) seg.addr + seg.size,
+                SHALLOC_MAGIC_PAGES_SIZE + SHALLOC_INHERIT_TABLE_MAX_SIZE
+                - seg.size, seg.size, PROT_READ|PROT_WRITE) < 0) {
+                shalloc_shm_close(ret);
+                ret = -1;
+                break;
+            }
+            magic_info = (shalloc_magic_t*) seg.addr;
+            magic_info->inherit_id = shalloc_space->control_fd = ret;
+            shalloc_space->thaw_gen = magic_info->thaw_gen;
+            magic_info->name[0] = '\0';
+            shalloc_space_init_lock(magic_info);
+            for (j = 0; j < magic_info->num_heaps; j++) {
+                magic_info->heap_list[j].inherit_id = -1;
+                shalloc_heap_init_lock(&magic_info->heap_list[j]);
+            }
+            for (j = 0; j < shalloc_space->max_inherit_slots; j++) {
+                shalloc_space->inherit_slots[j].fd = -1;
+            }
+            break;
+        case SHALLOC_CKPT_SEG_FILE_HEAP:
+            /* Mapped back like shalloc_heap_open() does. */
+            break;
+        case SHALLOC_CKPT_SEG_INHERIT_HEAP:
+            heap->inherit_id = ret;
+            j = heap - magic_info->heap_list;
+            shalloc_space->inherit_slots[j].fd = ret;
+            /* Fall through. */
+        default:
+            if (!heap) {
+                break;
+            }
+            /* The heap matches the checkpoint, track writes from now on. */
+            if ((heap->mmap_flags
+                & (SHALLOC_MAP_TRACK_DIRTY|SHALLOC_MAP_INHERIT))
+                == SHALLOC_MAP_TRACK_DIRTY
+                && shalloc_dirty_track(seg.addr, seg.size) == 0) {
+                shalloc_dirty_reset(seg.addr, seg.size);
+            }
+            /* Restored heaps map files, which cannot be wiped on fork. */
+            if (shalloc_fork_policy_pages(seg.addr, seg.size, 0,
+                heap->mmap_flags & SHALLOC_MAP_DONTFORK) < 0) {
+                ret = -1;
+                break;
+            }
+            /* Restored memfds are not sealed, but heaps stay frozen. */
+            if (heap->frozen) {
+                heap->frozen = SHALLOC_HEAP_FROZEN;
+                if (mprotect(seg.addr, seg.size, PROT_READ) < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+            ret = shalloc_numa_bind(seg.addr, seg.size, heap->numa_node);
+            break;
+        }
+        if (ret < 0) {
+            break;
+        }
+        ret = 0;
+    }
+    close(fd);
+    if (ret == 0 && (!shalloc_space || !magic_info)) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        if (magic_info) {
+            for (i = 0; i < magic_info->num_heaps; i++) {
+                if (magic_info->heap_list[i].inherit_id != -1) {
+                    shalloc_shm_close(magic_info->heap_list[i].inherit_id);
+                }
+            }
+            shalloc_shm_close(magic_info->inherit_id);
+        }
+        munmap(base_addr, header.base_size);
+        shalloc_space = NULL;
+        return -1;
+    }
+
+    /* Code addresses may differ in this process. */
+    memcpy(shalloc_space->buff_ops, shalloc_space_buff_ops,
+        sizeof(shalloc_buff_op_t)*__NUM_SHALLOC_BUFF_ALLOC_TYPES);
+    sprintf(magic_info->inherit_envp_buff, "%s=%d",
+        SHALLOC_INHERIT_ID, magic_info->inherit_id);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+#include "include/pagemap.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+/*
+ * Dirty page tracking of SHALLOC_MAP_TRACK_DIRTY heaps, with asynchronous
+ * userfaultfd write protection. Writes to protected pages are resolved by
+ * the kernel without any fault handler, leaving the page marked written.
+ * PAGEMAP_SCAN then returns the written pages of a range and protects them
+ * again in a single call, so tracking a heap never touches the rest of the
+ * process. Registrations are per process and are lost across fork(),
+ * scans of untracked ranges simply fail.
+ */
+#define SHALLOC_DIRTY_SCAN_RANGES   64
+
+#ifndef UFFD_FEATURE_WP_ASYNC
+#  define UFFD_FEATURE_WP_UNPOPULATED   (1 << 13)
+#  define UFFD_FEATURE_WP_ASYNC         (1 << 15)
+#endif
+
+static int shalloc_dirty_uffd = -1;
+static int shalloc_dirty_pagemap = -1;
+static pid_t shalloc_dirty_pid;
+
+/* Dirty tracking utility functions. */
+static int shalloc_dirty_open()
+{
+    struct uffdio_api api;
+    pid_t pid = getpid();
+
+    /* Both fds only work for the process that opened them. */
+    if (shalloc_dirty_uffd != -1 && shalloc_dirty_pid == pid) {
+        return 0;
+    }
+    shalloc_dirty_uffd = syscall(SYS_userfaultfd,
+        O_CLOEXEC|O_NONBLOCK|UFFD_USER_MODE_ONLY);
+    if (shalloc_dirty_uffd < 0) {
+        return -1;
+    }
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_WP_ASYNC|UFFD_FEATURE_WP_UNPOPULATED;
+    api.ioctls = 0;
+    shalloc_dirty_pagemap = open(SHALLOC_PAGEMAP_PATH, O_RDONLY|O_CLOEXEC);
+    if (ioctl(shalloc_dirty_uffd, UFFDIO_API, &api) < 0
+        || shalloc_dirty_pagemap < 0) {
+        close(shalloc_dirty_uffd);
+        if (shalloc_dirty_pagemap >= 0) {
+            close(shalloc_dirty_pagemap);
+        }
+        shalloc_dirty_uffd = shalloc_dirty_pagemap = -1;
+        return -1;
+    }
+    shalloc_dirty_pid = pid;
+    return 0;
+}
+
+/* Dirty tracking interface. */
+int shalloc_dirty_track(void *addr, size_t size)
+{
+    struct uffdio_register reg;
+
+    /* Newly registered pages all count as written. */
+    if (shalloc_dirty_open() < 0) {
+        return -1;
+    }
+    reg.range.start = (uintptr_t) addr;
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    return ioctl(shalloc_dirty_uffd, UFFDIO_REGISTER, &reg);
+}
+
+int shalloc_dirty_reset(void *addr, size_t size)
+{
+    struct uffdio_writeprotect wp;
+
+    if (shalloc_dirty_open() < 0) {
+        return -1;
+    }
+    wp.range.start = (uintptr_t) addr;
+    wp.range.len = size;
+    wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+    return ioctl(shalloc_dirty_uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+int shalloc_dirty_scan(void *addr, size_t size, shalloc_range_t *ranges,
+    int max_ranges, void **next)
+{
+    struct page_region regions[SHALLOC_DIRTY_SCAN_RANGES];
+    struct pm_scan_arg arg;
+    long ret, i;
+
+    /* Return written ranges from addr on and write protect them again. */
+    if (shalloc_dirty_open() < 0) {
+        return -1;
+    }
+    if (max_ranges > SHALLOC_DIRTY_SCAN_RANGES) {
+        max_ranges = SHALLOC_DIRTY_SCAN_RANGES;
+    }
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+    arg.flags = PM_SCAN_WP_MATCHING|PM_SCAN_CHECK_WPASYNC;
+    arg.start = (uintptr_t) addr;
+    arg.end = (uintptr_t) addr + size;
+    arg.vec = (uintptr_t) regions;
+    arg.vec_len = max_ranges;
+    arg.category_mask = PAGE_IS_WRITTEN;
+    arg.return_mask = PAGE_IS_WRITTEN;
+    ret = ioctl(shalloc_dirty_pagemap, PAGEMAP_SCAN, &arg);
+    if (ret < 0) {
+        return -1;
+    }
+    for (i = 0; i < ret; i++) {
+        ranges[i].start = (char*) (uintptr_t) regions[i].start;
+        ranges[i].size = regions[i].end - regions[i].start;
+    }
+    *next = (void*) (uintptr_t) arg.walk_end;
+    return ret;
+}
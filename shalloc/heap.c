@@ -1,32 +1,267 @@
 #include <shalloc/shalloc.h>
 #include "include/util.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Free descriptors are linked through their first word. */
+#define SHALLOC_HEAP_DESC_NEXT(H)   (*(shalloc_heap_t**)(H))
+
+/* File heaps keep their header right before the data. */
+#define SHALLOC_HEAP_FILE_HEADER(H) ((shalloc_file_header_t*) \
+    ((char*) shalloc_heap_to_buff(H)->start \
+    - shalloc_heap_header_size((H)->mmap_flags)))
+
 /* Heap utility functions. */
-shalloc_heap_t* shalloc_get_heap(shalloc_heap_t *heap, char *addr,
-    size_t size, int mmap_flags, enum shalloc_buff_alloc_type type)
+static size_t shalloc_heap_page_size(int mmap_flags)
 {
-    size_t data_size, base_size;
-    shalloc_buff_t *buff;
+    int huge_shift;
+
+    if (mmap_flags & MAP_HUGETLB) {
+        huge_shift = (mmap_flags >> MAP_HUGE_SHIFT) & MAP_HUGE_MASK;
+        return huge_shift ? ((size_t) 1) << huge_shift :
+            SHALLOC_HUGE_PAGE_SIZE;
+    }
+    if (mmap_flags & SHALLOC_MAP_HUGEPAGE) {
+        return SHALLOC_HUGE_PAGE_SIZE;
+    }
+    return SHALLOC_PAGE_SIZE;
+}
 
-    /* Page align. */
+static size_t shalloc_heap_header_size(int mmap_flags)
+{
+    if (!(mmap_flags & SHALLOC_MAP_FILE)) {
+        return 0;
+    }
+    return shalloc_heap_page_size(mmap_flags);
+}
+
+static size_t shalloc_heap_round_size(size_t size, size_t page_size)
+{
     assert(size > 0);
-    if (size % SHALLOC_PAGE_SIZE > 0) {
-        size = (size/SHALLOC_PAGE_SIZE)*SHALLOC_PAGE_SIZE;
+    if (size % page_size > 0) {
+        size = (size/page_size)*page_size;
         if (size == 0) {
-            size += SHALLOC_PAGE_SIZE;
+            size += page_size;
         }
     }
+    return size;
+}
+
+static size_t shalloc_heap_get_sizes(size_t size, size_t max_size,
+    int mmap_flags, size_t *data_size, size_t *max_data_size,
+    size_t *lead_size)
+{
+    size_t base_size, page_size = shalloc_heap_page_size(mmap_flags);
+
+    /* Leave room for allocator metadata and page align. */
+    if (size < max_size/SHALLOC_HEAP_GROWABLE_MIN_FRACTION) {
+        size = max_size/SHALLOC_HEAP_GROWABLE_MIN_FRACTION;
+    }
+    size = shalloc_heap_round_size(size, page_size);
+    max_size = max_size > size ?
+        shalloc_heap_round_size(max_size, page_size) : size;
 
     /* Compute size. */
-    data_size = size;
+    *data_size = size;
+    *max_data_size = max_size;
+    *lead_size = 0;
+    switch (mmap_flags & SHALLOC_MAP_GUARD_MASK) {
+    case SHALLOC_MAP_GUARD_NONE:
+        base_size = *max_data_size;
+        break;
+    case SHALLOC_MAP_GUARD_AROUND:
+        *lead_size = page_size;
+        /* Fall through. */
+    case SHALLOC_MAP_GUARD_TRAIL:
+        base_size = *lead_size + *max_data_size + SHALLOC_PAGE_SIZE;
+        break;
+    default:
 #if SHALLOC_USE_GUARD_PAGES
-    if (size > 100*SHALLOC_PAGE_SIZE) {
-        data_size -= SHALLOC_PAGE_SIZE;
-    }
-    base_size = data_size + SHALLOC_PAGE_SIZE;
+        if (max_size == size && size > 100*SHALLOC_PAGE_SIZE
+            && page_size == SHALLOC_PAGE_SIZE) {
+            *data_size -= SHALLOC_PAGE_SIZE;
+            *max_data_size -= SHALLOC_PAGE_SIZE;
+        }
+        base_size = *max_data_size + SHALLOC_PAGE_SIZE;
 #else
-    base_size = data_size;
+        base_size = *max_data_size;
 #endif
+        break;
+    }
+    *lead_size += shalloc_heap_header_size(mmap_flags);
+    base_size += shalloc_heap_header_size(mmap_flags);
+
+    return base_size;
+}
+
+static shalloc_heap_t* shalloc_heap_alloc_desc(int mmap_flags)
+{
+    shalloc_heap_t *heap;
+    shalloc_magic_t *magic_info;
+    shalloc_region_t *priv_region;
+    int i;
+
+    if (!(mmap_flags & SHALLOC_MAP_INHERIT)) {
+        /* Refill the free list with a new chunk of descriptors. */
+        if (!shalloc_space->free_heap_descs) {
+            priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+            heap = shalloc_malloc(priv_region, SHALLOC_HEAP_DESC_CHUNK_SIZE);
+            if (!heap) {
+                return NULL;
+            }
+            for (i = SHALLOC_HEAP_DESC_CHUNK_SIZE/sizeof(shalloc_heap_t) - 1;
+                i >= 0; i--) {
+                SHALLOC_HEAP_DESC_NEXT(&heap[i]) =
+                    shalloc_space->free_heap_descs;
+                shalloc_space->free_heap_descs = &heap[i];
+            }
+        }
+        heap = shalloc_space->free_heap_descs;
+        shalloc_space->free_heap_descs = SHALLOC_HEAP_DESC_NEXT(heap);
+        return heap;
+    }
+
+    /* Reuse the slots of destroyed inherit heaps first. */
+    magic_info = (shalloc_magic_t *) shalloc_space->magic_control_page;
+    for (i = 0; i < magic_info->num_heaps; i++) {
+        if (!magic_info->heap_list[i].base.start) {
+            break;
+        }
+    }
+    if (i == magic_info->num_heaps) {
+        if (magic_info->num_heaps == magic_info->max_heaps
+            && shalloc_space_grow_inherit_table() < 0) {
+            return NULL;
+        }
+        magic_info->num_heaps++;
+    }
+    heap = &magic_info->heap_list[i];
+    heap->inherit_id = -1;
+    heap->gen++;
+    magic_info->new_slot = i;
+    return heap;
+}
+
+static void shalloc_heap_free_desc(shalloc_heap_t *heap, int mmap_flags)
+{
+    shalloc_magic_t *magic_info;
+
+    if (!(mmap_flags & SHALLOC_MAP_INHERIT)) {
+        SHALLOC_HEAP_DESC_NEXT(heap) = shalloc_space->free_heap_descs;
+        shalloc_space->free_heap_descs = heap;
+        return;
+    }
+
+    /* Mark the slot free and drop trailing free slots from the list. */
+    magic_info = (shalloc_magic_t *) shalloc_space->magic_control_page;
+    heap->base.start = NULL;
+    heap->inherit_id = -1;
+    while (magic_info->num_heaps > 0
+        && !magic_info->heap_list[magic_info->num_heaps-1].base.start) {
+        magic_info->num_heaps--;
+    }
+}
+
+static int shalloc_heap_slot(shalloc_heap_t *heap)
+{
+    return heap - SHALLOC_CONTROL_DATA->heap_list;
+}
+
+static int shalloc_heap_open_fd(shalloc_heap_t *heap)
+{
+    if (heap->inherit_id == SHALLOC_HEAP_NAMED) {
+        return shalloc_shm_open_named(SHALLOC_CONTROL_DATA->name,
+            shalloc_heap_slot(heap), 0, 0);
+    }
+    return heap->inherit_id;
+}
+
+static void shalloc_heap_close_fd(shalloc_heap_t *heap, int fd)
+{
+    if (heap->inherit_id == SHALLOC_HEAP_NAMED) {
+        shalloc_shm_close(fd);
+    }
+}
+
+static void shalloc_unmap_heap(shalloc_heap_t *heap)
+{
+    /* Hand the range back to the shadow space reservation. */
+    shalloc_decommit_pages(heap->base.start, heap->base.size);
+
+    if (heap->inherit_id == SHALLOC_HEAP_NAMED) {
+        shalloc_shm_unlink_named(SHALLOC_CONTROL_DATA->name,
+            shalloc_heap_slot(heap));
+        heap->inherit_id = -1;
+    }
+    else if ((heap->mmap_flags & (SHALLOC_MAP_INHERIT|SHALLOC_MAP_FILE))
+        && heap->inherit_id != -1) {
+        shalloc_shm_close(heap->inherit_id);
+        heap->inherit_id = -1;
+    }
+}
+
+static int shalloc_heap_commit(shalloc_heap_t *heap, size_t offset,
+    size_t size)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+    char *addr = (char*) data->start + offset;
+    int prot = heap->frozen ? PROT_READ : PROT_READ|PROT_WRITE;
+    int fd, ret;
+
+    if (heap->mmap_flags & (SHALLOC_MAP_INHERIT|SHALLOC_MAP_FILE)) {
+        offset += shalloc_heap_header_size(heap->mmap_flags);
+        fd = shalloc_heap_open_fd(heap);
+        if (fd < 0) {
+            return -1;
+        }
+        ret = 0;
+        if (shalloc_shm_get_size(fd) < offset + size
+            && shalloc_shm_resize(fd, offset + size) < 0) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = shalloc_shm_map(fd, addr, size, offset, prot);
+        }
+        shalloc_heap_close_fd(heap, fd);
+        if (ret < 0) {
+            return -1;
+        }
+        if (heap->mmap_flags & SHALLOC_MAP_HUGEPAGE) {
+            madvise(addr, size, MADV_HUGEPAGE);
+        }
+    }
+    else if (shalloc_commit_pages(addr, size, heap->mmap_flags) < 0) {
+        return -1;
+    }
+
+    if (shalloc_fork_policy_pages(addr, size, 0, heap->mmap_flags) < 0) {
+        return -1;
+    }
+
+    /* Without tracking, heaps are simply checkpointed in full. */
+    if ((heap->mmap_flags & (SHALLOC_MAP_TRACK_DIRTY|SHALLOC_MAP_INHERIT))
+        == SHALLOC_MAP_TRACK_DIRTY) {
+        shalloc_dirty_track(addr, size);
+    }
+
+    /* Set the NUMA policy before anything is touched. */
+    if (shalloc_numa_bind(addr, size, heap->numa_node) < 0) {
+        return -1;
+    }
+    return shalloc_prefault_pages(addr, size, heap->mmap_flags, prot);
+}
+
+shalloc_heap_t* shalloc_get_heap(shalloc_heap_t *heap, char *addr,
+    size_t size, size_t max_size, int mmap_flags,
+    enum shalloc_buff_alloc_type type)
+{
+    size_t data_size, max_data_size, lead_size, base_size;
+    shalloc_buff_t *buff;
+
+    base_size = shalloc_heap_get_sizes(size, max_size, mmap_flags,
+        &data_size, &max_data_size, &lead_size);
 
     /* Fill in information. */
     buff = &heap->base;
@@ -36,143 +271,534 @@ shalloc_heap_t* shalloc_get_heap(shalloc_heap_t *heap, char *addr,
         SHALLOC_HEAP_TYPE_DEFAULT);
     buff = &heap->region.default_data;
     heap->region.data_head = heap->region.data_tail = buff;
-    shalloc_get_buff(buff, addr, data_size, 0,
+    shalloc_get_buff(buff, addr + lead_size, data_size, 0,
         type, SHALLOC_HEAP_TYPE_DEFAULT);
+    buff->max_size = max_data_size;
     heap->mmap_flags = mmap_flags;
+    heap->numa_node = SHALLOC_NUMA_ANY;
+    heap->frozen = 0;
+    shalloc_heap_init_lock(heap);
 
     return heap;
 }
 
-int shalloc_map_heap(shalloc_heap_t *heap)
+int shalloc_heap_init_lock(shalloc_heap_t *heap)
 {
-    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
-    int remapped = 0, inherit_mem_id;
-    char *inherit_mem_ptr;
+    pthread_mutexattr_t attr;
+    int ret;
 
-    if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
-        if (heap->inherit_id == -1) {
-            inherit_mem_id = shmget(IPC_PRIVATE, data->size, SHM_R | SHM_W);
-            assert(inherit_mem_id != -1);
-            inherit_mem_ptr = shmat(inherit_mem_id, data->start, SHM_REMAP);
-            assert(inherit_mem_ptr != MAP_FAILED);
-            heap->inherit_id = inherit_mem_id;
+    /* Inherit heap descriptors, and so their locks, are shared memory. */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    ret = pthread_mutex_init(&heap->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return ret == 0 ? 0 : -1;
+}
+
+int shalloc_heap_lock(shalloc_heap_t *heap)
+{
+    shalloc_buff_t *data;
+    int ret;
+
+    if (!(heap->mmap_flags & SHALLOC_MAP_INHERIT)) {
+        return heap->frozen ? -1 : 0;
+    }
+    ret = pthread_mutex_lock(&heap->lock);
+    if (ret == EOWNERDEAD) {
+        /*
+         * The owner died holding the lock, maybe halfway through an
+         * allocator operation. Unlocking without marking the lock
+         * consistent makes it unrecoverable, failing every later lock.
+         */
+        data = shalloc_heap_to_buff(heap);
+        if (!data->op->repair || data->op->repair(data) < 0) {
+            pthread_mutex_unlock(&heap->lock);
+            return -1;
+        }
+        pthread_mutex_consistent(&heap->lock);
+    }
+    else if (ret != 0) {
+        return -1;
+    }
+
+    /*
+     * Another process may have frozen the heap in the meantime, or thawed
+     * it while it is still mapped read-only here.
+     */
+    if (heap->frozen || shalloc_space_sync_thawed() < 0) {
+        pthread_mutex_unlock(&heap->lock);
+        return -1;
+    }
+    return 0;
+}
+
+int shalloc_space_sync_thawed()
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    unsigned thaw_gen = magic_info->thaw_gen;
+    shalloc_heap_t *heap;
+    shalloc_buff_t *data;
+    int i;
 
-            // mark for delete
-            shmctl(inherit_mem_id, IPC_RMID, NULL);
-        } else {
-            inherit_mem_ptr = shmat(heap->inherit_id, data->start, SHM_REMAP);
-            assert(inherit_mem_ptr != MAP_FAILED);
+    if (shalloc_space->thaw_gen == thaw_gen) {
+        return 0;
+    }
+
+    /* Remap the thawed inherit heaps mapped here, writable again. */
+    for (i = 0; i < magic_info->num_heaps; i++) {
+        heap = &magic_info->heap_list[i];
+        if (!heap->base.start || heap->frozen) {
+            continue;
+        }
+        data = shalloc_heap_to_buff(heap);
+        if (shalloc_ptr_to_heap(data->start) == heap
+            && shalloc_heap_commit(heap, 0, data->size) < 0) {
+            return -1;
         }
-        remapped = 1;
+    }
+    shalloc_space->thaw_gen = thaw_gen;
+    return 0;
+}
 
-    } else if (heap->mmap_flags != SHALLOC_DEFAULT_MMAP_FLAGS) {
-        /* Remap the heap with the right flags if necessary. */
-        shalloc_map_fixed_pages(data->start, data->size,
-            PROT_READ|PROT_WRITE, heap->mmap_flags);
-        remapped = 1;
+void shalloc_heap_unlock(shalloc_heap_t *heap)
+{
+    if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
+        pthread_mutex_unlock(&heap->lock);
     }
+}
 
-    if (heap->base.size > data->size) {
-        /* Add guard page. */
-        shalloc_map_fixed_pages((char*)data->start+data->size,
-            SHALLOC_PAGE_SIZE, PROT_NONE, MAP_ANONYMOUS|MAP_PRIVATE);
-        remapped = 1;
+int shalloc_map_heap(shalloc_heap_t *heap)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+    int fd;
+
+    if ((heap->mmap_flags & SHALLOC_MAP_INHERIT) && heap->inherit_id == -1
+        && SHALLOC_CONTROL_DATA->name[0]) {
+        fd = shalloc_shm_open_named(SHALLOC_CONTROL_DATA->name,
+            shalloc_heap_slot(heap), O_CREAT|O_TRUNC, data->size);
+        if (fd == -1) {
+            return -1;
+        }
+        shalloc_shm_close(fd);
+        heap->inherit_id = SHALLOC_HEAP_NAMED;
+    }
+    if ((heap->mmap_flags & SHALLOC_MAP_INHERIT) && heap->inherit_id == -1) {
+        heap->inherit_id = shalloc_shm_create(data->size, heap->mmap_flags);
+        if (heap->inherit_id == -1) {
+            return -1;
+        }
+    }
+    if ((heap->mmap_flags & SHALLOC_MAP_FILE)
+        && shalloc_shm_map(heap->inherit_id, SHALLOC_HEAP_FILE_HEADER(heap),
+        shalloc_heap_header_size(heap->mmap_flags), 0,
+        PROT_READ|PROT_WRITE) < 0) {
+        return -1;
     }
 
-    return remapped;
+    /*
+     * Commit the heap data out of the reserved shadow space. Guard pages
+     * and the uncommitted part of growable heaps are simply left reserved.
+     */
+    return shalloc_heap_commit(heap, 0, data->size);
 }
 
 void shalloc_heap_destroy(shalloc_heap_t* heap)
 {
+    shalloc_space_lock();
+    shalloc_space_del_heap(heap);
+    shalloc_unmap_heap(heap);
+    shalloc_space_free_range(heap->base.start, heap->base.size);
+    shalloc_heap_free_desc(heap, heap->mmap_flags);
+    shalloc_space_unlock();
+}
+
+static shalloc_heap_t* shalloc_heap_create_locked(size_t size,
+    size_t max_size, size_t block_size, int mmap_flags,
+    enum shalloc_buff_alloc_type type, int node, int fd)
+{
+    shalloc_heap_t *heap;
     shalloc_buff_t *data;
-    shalloc_magic_t *magic_info;
+    size_t data_size, max_data_size, lead_size, base_size;
+    char *addr;
 
-    data = shalloc_heap_to_buff(heap);
+    /* Allocate heap object, knowing about the heaps of other processes. */
+    shalloc_space_sync_heaps(0);
+    heap = shalloc_heap_alloc_desc(mmap_flags);
+    if (!heap) {
+        if (fd != -1) {
+            shalloc_shm_close(fd);
+        }
+        return NULL;
+    }
 
-    if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
-        if (heap->inherit_id != -1) {
-            shmdt(data->start);
-            shmctl(heap->inherit_id, IPC_RMID, NULL);
-            heap->inherit_id = -1;
+    /* Figure out if we have enough space for the new heap. */
+    base_size = shalloc_heap_get_sizes(size, max_size, mmap_flags,
+        &data_size, &max_data_size, &lead_size);
+    addr = shalloc_space_alloc_range(base_size,
+        shalloc_heap_page_size(mmap_flags), mmap_flags & SHALLOC_MAP_INHERIT);
+    if (!addr) {
+        if (fd != -1) {
+            shalloc_shm_close(fd);
         }
-        magic_info = (shalloc_magic_t *) shalloc_space->magic_control_page;
-        magic_info->num_heaps--;
-    } else {
-        shalloc_free(shalloc_heap_to_region(shalloc_space->priv_heap), heap);
+        shalloc_heap_free_desc(heap, mmap_flags);
+        return NULL;
+    }
+    shalloc_get_heap(heap, addr, size, max_size, mmap_flags, type);
+    heap->numa_node = node;
+    heap->inherit_id = fd;
+
+    /* Map the new heap, create data buffer and update shadow space. */
+    data = shalloc_heap_to_buff(heap);
+    data->block_size = block_size;
+    if (shalloc_map_heap(heap) < 0 || data->op->create(data) < 0
+        || shalloc_space_new_heap(heap) < 0) {
+        shalloc_unmap_heap(heap);
+        shalloc_space_free_range(addr, base_size);
+        shalloc_heap_free_desc(heap, mmap_flags);
+        return NULL;
     }
 
-    munmap(heap->base.start, heap->base.size);
+    return heap;
+}
+
+static shalloc_heap_t* shalloc_heap_create_max(size_t size, size_t max_size,
+    size_t block_size, int mmap_flags, enum shalloc_buff_alloc_type type,
+    int node, int fd)
+{
+    shalloc_heap_t *heap;
+
+    assert(shalloc_space && "shalloc_space not initialized");
+    shalloc_space_lock();
+    heap = shalloc_heap_create_locked(size, max_size, block_size, mmap_flags,
+        type, node, fd);
+    SHALLOC_CONTROL_DATA->new_slot = -1;
+    shalloc_space_unlock();
+
+    return heap;
 }
 
 /* Shalloc heap allocator interface. */
 shalloc_heap_t* shalloc_heap_create(size_t size, int mmap_flags,
     enum shalloc_buff_alloc_type type)
+{
+    return shalloc_heap_create_max(size, 0, 0,
+        mmap_flags & ~(SHALLOC_MAP_GROWABLE|SHALLOC_MAP_FILE), type,
+        SHALLOC_NUMA_ANY, -1);
+}
+
+shalloc_heap_t* shalloc_heap_create_with_block_size(size_t size,
+    size_t block_size, int mmap_flags, enum shalloc_buff_alloc_type type)
+{
+    return shalloc_heap_create_max(size, 0, block_size,
+        mmap_flags & ~(SHALLOC_MAP_GROWABLE|SHALLOC_MAP_FILE), type,
+        SHALLOC_NUMA_ANY, -1);
+}
+
+shalloc_heap_t* shalloc_heap_create_on_node(size_t size, int mmap_flags,
+    enum shalloc_buff_alloc_type type, int node)
+{
+    if (node >= SHALLOC_NUMA_MAX_NODES || node < SHALLOC_NUMA_INTERLEAVE) {
+        return NULL;
+    }
+    return shalloc_heap_create_max(size, 0, 0,
+        mmap_flags & ~(SHALLOC_MAP_GROWABLE|SHALLOC_MAP_FILE), type, node, -1);
+}
+
+shalloc_heap_t* shalloc_heap_create_growable(size_t size, size_t max_size,
+    int mmap_flags, enum shalloc_buff_alloc_type type)
+{
+    if (!type) {
+        type = SHALLOC_HEAP_TYPE_DEFAULT;
+    }
+    if (max_size < size || !shalloc_space_buff_ops[type].extend) {
+        return NULL;
+    }
+    return shalloc_heap_create_max(size, max_size, 0,
+        (mmap_flags & ~SHALLOC_MAP_FILE) | SHALLOC_MAP_GROWABLE, type,
+        SHALLOC_NUMA_ANY, -1);
+}
+
+int shalloc_heap_grow(shalloc_heap_t* heap, size_t size)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+    size_t page_size = shalloc_heap_page_size(heap->mmap_flags);
+    size_t old_size = data->size, new_size;
+
+    if (!(heap->mmap_flags & SHALLOC_MAP_GROWABLE)
+        || old_size == data->max_size || heap->frozen) {
+        return -1;
+    }
+
+    /* At least double, so a heap only grows a logarithmic number of times. */
+    new_size = old_size + (size > old_size ? size : old_size);
+    new_size = ((new_size + page_size - 1)/page_size)*page_size;
+    if (new_size > data->max_size || new_size < old_size) {
+        new_size = data->max_size;
+    }
+
+    /* Commit the new tail and hand it to the allocator. */
+    if (shalloc_heap_commit(heap, old_size, new_size - old_size) < 0
+        || data->op->extend(data, new_size) < 0) {
+        return -1;
+    }
+    data->size = new_size;
+    data->end = (char*)data->start + new_size - 1;
+    data->unused_size += new_size - old_size;
+
+    return 0;
+}
+
+shalloc_heap_t* shalloc_heap_create_file(const char *path, size_t size,
+    int mmap_flags, enum shalloc_buff_alloc_type type)
 {
     shalloc_heap_t *heap;
     shalloc_buff_t *data;
-    shalloc_region_t *priv_region;
-    shalloc_magic_t *magic_info;
-    int remapped;
-    char *addr;
+    shalloc_file_header_t *header;
+    int fd;
+
+    if (mmap_flags & (SHALLOC_MAP_INHERIT|SHALLOC_MAP_GROWABLE)) {
+        return NULL;
+    }
+    fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    mmap_flags &= ~(MAP_PRIVATE|MAP_ANONYMOUS);
+    mmap_flags |= MAP_SHARED|SHALLOC_MAP_FILE;
+    heap = shalloc_heap_create_max(size, 0, 0, mmap_flags, type,
+        SHALLOC_NUMA_ANY, fd);
+    if (!heap) {
+        unlink(path);
+        return NULL;
+    }
+
+    /* Record everything needed to map the heap back. */
+    data = shalloc_heap_to_buff(heap);
+    header = SHALLOC_HEAP_FILE_HEADER(heap);
+    header->version = SHALLOC_FILE_VERSION;
+    header->base_addr = heap->base.start;
+    header->base_size = heap->base.size;
+    header->data_size = data->size;
+    header->size = size;
+    header->mmap_flags = mmap_flags;
+    header->alloc_type = data->alloc_type;
+    header->root = NULL;
+    header->magic = SHALLOC_FILE_MAGIC;
+
+    return heap;
+}
+
+shalloc_heap_t* shalloc_heap_open(const char *path)
+{
+    shalloc_file_header_t header;
+    shalloc_heap_t *heap;
+    size_t data_size, max_data_size, lead_size, base_size;
+    int fd;
 
-    /* Allocate heap object. */
     assert(shalloc_space && "shalloc_space not initialized");
-    if (mmap_flags & SHALLOC_MAP_INHERIT) {
-        magic_info = (shalloc_magic_t *) shalloc_space->magic_control_page;
-        assert(magic_info->num_heaps < SHALLOC_MAX_INHERIT_HEAPS && "Out of space for inherit heaps");
-        heap = &magic_info->heap_list[magic_info->num_heaps];
-        heap->inherit_id = -1;
-        magic_info->num_heaps++;
-    } else {
-        priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
-        heap = shalloc_malloc(priv_region, sizeof(shalloc_heap_t));
-        assert(heap && "Out of private heap memory!");
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
     }
 
-    /* Figure out if we have enough space for the new heap. */
-    addr = (char*)shalloc_space->data.start + shalloc_space->data.size
-        - shalloc_space->data.unused_size;
-    assert(addr <= (char*)shalloc_space->data.end);
-    shalloc_get_heap(heap, addr, size, mmap_flags, type);
-    if (addr + heap->base.size > (char*)shalloc_space->data.end+1) {
-        if (mmap_flags & SHALLOC_MAP_INHERIT) {
-            magic_info = (shalloc_magic_t *) shalloc_space->magic_control_page;
-            magic_info->num_heaps--;
-        } else {
-            shalloc_free(priv_region, heap);
-        }
+    /* Validate the header against the current configuration. */
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != SHALLOC_FILE_MAGIC
+        || header.version != SHALLOC_FILE_VERSION
+        || !(header.mmap_flags & SHALLOC_MAP_FILE)
+        || header.alloc_type <= SHALLOC_BUFF_ALLOC_TYPE_NONE
+        || header.alloc_type >= __NUM_SHALLOC_BUFF_ALLOC_TYPES) {
+        shalloc_shm_close(fd);
+        return NULL;
+    }
+    base_size = shalloc_heap_get_sizes(header.size, 0, header.mmap_flags,
+        &data_size, &max_data_size, &lead_size);
+    if (base_size != header.base_size || data_size != header.data_size
+        || shalloc_shm_get_size(fd) < data_size
+        + shalloc_heap_header_size(header.mmap_flags)) {
+        shalloc_shm_close(fd);
+        return NULL;
+    }
+
+    /* The heap must go back to its original address. */
+    shalloc_space_lock();
+    shalloc_space_sync_heaps(0);
+    if (shalloc_space_reserve_range(header.base_addr, base_size, 0) < 0) {
+        shalloc_space_unlock();
+        shalloc_shm_close(fd);
+        return NULL;
+    }
+    heap = shalloc_heap_alloc_desc(header.mmap_flags);
+    if (!heap) {
+        shalloc_space_free_range(header.base_addr, base_size);
+        shalloc_space_unlock();
+        shalloc_shm_close(fd);
         return NULL;
     }
+    shalloc_get_heap(heap, header.base_addr, header.size, 0,
+        header.mmap_flags, header.alloc_type);
+    heap->inherit_id = fd;
+    if (shalloc_map_heap(heap) < 0 || shalloc_space_new_heap(heap) < 0) {
+        shalloc_unmap_heap(heap);
+        shalloc_space_free_range(header.base_addr, base_size);
+        shalloc_heap_free_desc(heap, header.mmap_flags);
+        heap = NULL;
+    }
+    shalloc_space_unlock();
 
-    /* Map the new heap. */
-    remapped = shalloc_map_heap(heap);
+    return heap;
+}
 
-    /* Create data buffer. */
-    data = shalloc_heap_to_buff(heap);
-    if (data->op->create(data) < 0) {
-        if (remapped) {
-            /* Detach if shared */
-            if (mmap_flags & SHALLOC_MAP_INHERIT) {
-                shmdt(data->start);
-                shmctl(heap->inherit_id, IPC_RMID, NULL);
-                heap->inherit_id = -1;
-            }
-            shalloc_map_fixed_pages(data->start, data->size,
-                PROT_READ|PROT_WRITE, SHALLOC_DEFAULT_MMAP_FLAGS);
+int shalloc_heap_reopen(shalloc_heap_t *heap, const char *path)
+{
+    shalloc_file_header_t header;
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+    int fd;
+
+    /* The descriptor is restored already, the file must still match it. */
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != SHALLOC_FILE_MAGIC
+        || header.version != SHALLOC_FILE_VERSION
+        || header.base_addr != heap->base.start
+        || header.base_size != heap->base.size
+        || header.data_size != data->size) {
+        shalloc_shm_close(fd);
+        return -1;
+    }
+    heap->inherit_id = fd;
+    if (shalloc_map_heap(heap) < 0) {
+        shalloc_unmap_heap(heap);
+        return -1;
+    }
+    return 0;
+}
+
+void shalloc_heap_set_root(shalloc_heap_t* heap, void *root)
+{
+    assert(heap->mmap_flags & SHALLOC_MAP_FILE);
+    SHALLOC_HEAP_FILE_HEADER(heap)->root = root;
+}
+
+void* shalloc_heap_get_root(shalloc_heap_t* heap)
+{
+    assert(heap->mmap_flags & SHALLOC_MAP_FILE);
+    return SHALLOC_HEAP_FILE_HEADER(heap)->root;
+}
+
+int shalloc_heap_sync(shalloc_heap_t* heap)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+
+    if (!(heap->mmap_flags & SHALLOC_MAP_FILE)) {
+        return -1;
+    }
+    return msync(SHALLOC_HEAP_FILE_HEADER(heap), data->size
+        + shalloc_heap_header_size(heap->mmap_flags), MS_SYNC);
+}
+
+int shalloc_heap_set_fork_policy(shalloc_heap_t* heap,
+    enum shalloc_fork_policy policy)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+    int mmap_flags = heap->mmap_flags & ~SHALLOC_MAP_FORK_MASK;
+
+    /* Sharing is decided by the mapping, set at creation. */
+    switch (policy) {
+    case SHALLOC_FORK_COPY:
+    case SHALLOC_FORK_SHARE:
+        if (!(mmap_flags & MAP_SHARED) != (policy == SHALLOC_FORK_COPY)) {
+            return -1;
         }
-        if (mmap_flags & SHALLOC_MAP_INHERIT) {
-            magic_info = (shalloc_magic_t *) shalloc_space->magic_control_page;
-            magic_info->num_heaps--;
-        } else {
-            shalloc_free(priv_region, heap);
+        break;
+    case SHALLOC_FORK_WIPE:
+        if (mmap_flags & (MAP_SHARED|SHALLOC_MAP_FILE)) {
+            return -1;
         }
-        return NULL;
+        mmap_flags |= SHALLOC_MAP_WIPEONFORK;
+        break;
+    case SHALLOC_FORK_DROP:
+        mmap_flags |= SHALLOC_MAP_DONTFORK;
+        break;
+    default:
+        return -1;
     }
+    if (shalloc_fork_policy_pages(data->start, data->size, heap->mmap_flags,
+        mmap_flags) < 0) {
+        return -1;
+    }
+    heap->mmap_flags = mmap_flags;
+    return 0;
+}
 
-    /* Update shadow space. */
-    shalloc_space_new_heap(heap);
+int shalloc_heap_freeze(shalloc_heap_t* heap)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
 
-    return heap;
+    /* Wait for allocations in progress, unless frozen already. */
+    if (!heap->frozen && shalloc_heap_lock(heap) == 0) {
+        heap->frozen = SHALLOC_HEAP_FROZEN;
+        shalloc_heap_unlock(heap);
+    }
+    if (!heap->frozen) {
+        return -1;
+    }
+    return mprotect(data->start, data->size, PROT_READ);
+}
+
+int shalloc_heap_thaw(shalloc_heap_t* heap)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+    unsigned thaw_gen;
+
+    if (heap->frozen == SHALLOC_HEAP_SEALED
+        || mprotect(data->start, data->size, PROT_READ|PROT_WRITE) < 0) {
+        return -1;
+    }
+    heap->frozen = 0;
+
+    /* Have other processes remap the heap, we are done unless behind. */
+    if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
+        thaw_gen = __sync_add_and_fetch(&SHALLOC_CONTROL_DATA->thaw_gen, 1);
+        if (shalloc_space->thaw_gen == thaw_gen - 1) {
+            shalloc_space->thaw_gen = thaw_gen;
+        }
+    }
+    return 0;
+}
+
+int shalloc_heap_seal(shalloc_heap_t* heap)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+
+    /* Only memfds can be sealed, not named or file heaps. */
+    if (!(heap->mmap_flags & SHALLOC_MAP_INHERIT) || heap->inherit_id < 0
+        || shalloc_heap_freeze(heap) < 0) {
+        return -1;
+    }
+    if (heap->frozen != SHALLOC_HEAP_SEALED) {
+        if (shalloc_shm_seal(heap->inherit_id) < 0) {
+            return -1;
+        }
+        heap->frozen = SHALLOC_HEAP_SEALED;
+    }
+
+    /* Mappings made after sealing can never be made writable. */
+    return shalloc_heap_commit(heap, 0, data->size);
+}
+
+int shalloc_heap_get_usage(shalloc_heap_t* heap, shalloc_usage_t *usage)
+{
+    shalloc_buff_t *data = shalloc_heap_to_buff(heap);
+
+    /* Only the committed part of growable heaps can be in use. */
+    memset(usage, 0, sizeof(shalloc_usage_t));
+    return shalloc_usage_add(data->start, data->size,
+        heap->mmap_flags & SHALLOC_MAP_FILE, usage);
 }
 
 shalloc_region_t* shalloc_heap_to_region(shalloc_heap_t* heap)
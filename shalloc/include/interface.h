@@ -5,6 +5,7 @@
 int _buffer_create(void *ref);
 void* _buffer_malloc(void *ref, size_t size);
 void _buffer_free(void *ref, void *ptr);
+int _buffer_repair(void *ref);
 
 /* Simple allocator interface. */
 int _simple_create(void *ref);
@@ -15,18 +16,22 @@ void _simple_free(void *ref, void *ptr);
 int _mplite_create(void *ref);
 void* _mplite_malloc(void *ref, size_t size);
 void _mplite_free(void *ref, void *ptr);
+int _mplite_extend(void *ref, size_t size);
+int _mplite_repair(void *ref);
 
 /* No-free allocator interface. */
 int _nofree_create(void *ref);
 void _nofree_destroy(void *ref);
 void* _nofree_malloc(void *ref, size_t size);
 void _nofree_free(void *ref, void *ptr);
+int _nofree_repair(void *ref);
 
 /* Slab allocator interface. */
 int _slab_create(void *ref);
 void _slab_destroy(void *ref);
 void* _slab_malloc(void *ref, size_t size);
 void _slab_free(void *ref, void *ptr);
+int _slab_repair(void *ref);
 
 #endif /* SHALLOC_INTERFACE_H */
 
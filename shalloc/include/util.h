@@ -2,9 +2,49 @@
 #define SHALLOC_UTIL_H
 
 /* Utility functions. */
-void shalloc_space_new_heap(shalloc_heap_t *heap);
+char* shalloc_space_reserve(char *base_addr, size_t size);
+int shalloc_space_new_heap(shalloc_heap_t *heap);
+void shalloc_space_del_heap(shalloc_heap_t *heap);
+void shalloc_space_lock();
+void shalloc_space_unlock();
+void shalloc_space_init_lock(shalloc_magic_t *magic_info);
+void shalloc_space_sync_heaps(int map_all);
+int shalloc_space_grow_inherit_table();
 void shalloc_map_fixed_pages(void *addr, size_t size, int prot,
     int mmap_flags);
+int shalloc_commit_pages(void *addr, size_t size, int mmap_flags);
+void shalloc_decommit_pages(void *addr, size_t size);
+int shalloc_fork_policy_pages(void *addr, size_t size, int old_mmap_flags,
+    int mmap_flags);
+
+int shalloc_shm_create(size_t size, int mmap_flags);
+int shalloc_shm_resize(int fd, size_t size);
+size_t shalloc_shm_get_size(int fd);
+int shalloc_shm_map(int fd, void *addr, size_t size, size_t offset,
+    int prot);
+int shalloc_shm_seal(int fd);
+void shalloc_shm_close(int fd);
+int shalloc_shm_open_named(const char *name, int slot, int flags,
+    size_t size);
+void shalloc_shm_unlink_named(const char *name, int slot);
+
+int shalloc_numa_bind(void *addr, size_t size, int node);
+int shalloc_prefault_pages(void *addr, size_t size, int mmap_flags,
+    int prot);
+int shalloc_usage_add(void *addr, size_t size, int file,
+    shalloc_usage_t *usage);
+int shalloc_dirty_track(void *addr, size_t size);
+int shalloc_dirty_reset(void *addr, size_t size);
+int shalloc_dirty_scan(void *addr, size_t size, shalloc_range_t *ranges,
+    int max_ranges, void **next);
+int shalloc_ptrmap_set(void *addr, size_t size, shalloc_region_t *region);
+int shalloc_ptrmap_add_buff(shalloc_buff_t *buff, shalloc_region_t *region);
+void shalloc_ptrmap_del_buff(shalloc_buff_t *buff, shalloc_region_t *region);
+
+void shalloc_space_init_ranges();
+void* shalloc_space_alloc_range(size_t size, size_t align, int shared);
+int shalloc_space_reserve_range(void *addr, size_t size, int shared);
+void shalloc_space_free_range(void *addr, size_t size);
 
 shalloc_buff_t* shalloc_get_buff(shalloc_buff_t *buff,
     void *start, size_t size, size_t block_size,
@@ -14,9 +54,15 @@ shalloc_buff_t* shalloc_clone_buff(shalloc_buff_t *buff,
     void *start, size_t size, shalloc_buff_t *from_buff);
 
 shalloc_heap_t* shalloc_get_heap(shalloc_heap_t *heap, char *addr,
-    size_t size, int mmap_flags, enum shalloc_buff_alloc_type type);
+    size_t size, size_t max_size, int mmap_flags,
+    enum shalloc_buff_alloc_type type);
 int shalloc_map_heap(shalloc_heap_t *heap);
+int shalloc_heap_reopen(shalloc_heap_t *heap, const char *path);
 void shalloc_heap_destroy(shalloc_heap_t* heap);
+int shalloc_heap_init_lock(shalloc_heap_t *heap);
+int shalloc_heap_lock(shalloc_heap_t *heap);
+int shalloc_space_sync_thawed();
+void shalloc_heap_unlock(shalloc_heap_t *heap);
 
 shalloc_region_t* shalloc_get_region(shalloc_region_t *region,
     shalloc_region_t *parent, size_t buff_size, size_t block_size, int flags,
@@ -21,3 +21,8 @@ void _buffer_free(void *ref, void *ptr)
     alloc_free(buff->start, buff->size, ptr);
 }
 
+int _buffer_repair(void *ref)
+{
+    shalloc_buff_t *buff = (shalloc_buff_t*) ref;
+    return alloc_check(buff->start, buff->size) ? 0 : -1;
+}
@@ -24,3 +24,8 @@ void _nofree_free(void *ref, void *ptr)
 {
 }
 
+int _nofree_repair(void *ref)
+{
+    shalloc_buff_t *buff = (shalloc_buff_t*) ref;
+    return nofree_repair(buff->start, buff->size);
+}
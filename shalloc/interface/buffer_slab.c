@@ -26,3 +26,9 @@ void _slab_free(void *ref, void *ptr)
     shalloc_buff_t *buff = (shalloc_buff_t*) ref;
     slab_free(buff->start, ptr);
 }
+
+int _slab_repair(void *ref)
+{
+    shalloc_buff_t *buff = (shalloc_buff_t*) ref;
+    return slab_repair(buff->start);
+}
@@ -2,18 +2,32 @@
 #include <mplite/mplite.h>
 
 #define MPLITE_MIN_ALLOC    64
+#define MPLITE_SLOT_SIZE    16
 
 /* Mplite allocator interface. */
 int _mplite_create(void *ref)
 {
     shalloc_buff_t *buff = (shalloc_buff_t*) ref;
     mplite_t *handle = (mplite_t*) buff->start;
+    size_t block_size = MPLITE_SLOT_SIZE;
     int ret;
     if (buff->size <= sizeof(mplite_t)) {
         return -1;
     }
-    ret = mplite_init(handle, handle+1, buff->size-sizeof(mplite_t),
-        MPLITE_MIN_ALLOC, NULL);
+
+    /*
+     * Block sizes are rounded up to a power of two, those below the
+     * minimum allocation are run slot sizes.
+     */
+    if (buff->block_size) {
+        for (block_size = 8; block_size < buff->block_size; block_size <<= 1);
+    }
+    ret = mplite_init_growable(handle, handle+1, buff->size-sizeof(mplite_t),
+        buff->max_size-sizeof(mplite_t),
+        block_size < MPLITE_MIN_ALLOC ? MPLITE_MIN_ALLOC : block_size, NULL);
+    if (ret == MPLITE_OK && block_size < MPLITE_MIN_ALLOC) {
+        ret = mplite_init_runs(handle, block_size);
+    }
     return ret == MPLITE_OK ? 0 : -1;
 }
 
@@ -30,3 +44,19 @@ void _mplite_free(void *ref, void *ptr)
     mplite_t *handle = (mplite_t*) buff->start;
     mplite_free(handle, ptr);
 }
+
+int _mplite_extend(void *ref, size_t size)
+{
+    shalloc_buff_t *buff = (shalloc_buff_t*) ref;
+    mplite_t *handle = (mplite_t*) buff->start;
+    int ret;
+    ret = mplite_grow(handle, size-sizeof(mplite_t));
+    return ret == MPLITE_OK ? 0 : -1;
+}
+
+int _mplite_repair(void *ref)
+{
+    shalloc_buff_t *buff = (shalloc_buff_t*) ref;
+    mplite_t *handle = (mplite_t*) buff->start;
+    return mplite_repair(handle) == MPLITE_OK ? 0 : -1;
+}
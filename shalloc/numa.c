@@ -0,0 +1,154 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+ * NUMA placement through the raw mbind() and getcpu() system calls, so no
+ * libnuma is needed. Kernels without NUMA support (ENOSYS) are treated as
+ * a single node and bindings become no-ops.
+ */
+#define SHALLOC_NUMA_ONLINE_PATH    "/sys/devices/system/node/online"
+#define SHALLOC_NUMA_LONG_BITS      (8*sizeof(unsigned long))
+#define SHALLOC_NUMA_MASK_LONGS \
+    ((SHALLOC_NUMA_MAX_NODES + SHALLOC_NUMA_LONG_BITS - 1) \
+    / SHALLOC_NUMA_LONG_BITS)
+
+#ifndef MPOL_BIND
+#  define MPOL_BIND         2
+#  define MPOL_INTERLEAVE   3
+#endif
+
+/* NUMA utility functions. */
+static int shalloc_numa_get_online(unsigned long *mask)
+{
+    FILE *file;
+    int first, last, num_nodes = 0;
+    char sep;
+
+    /* Parse a node list such as "0-1,3". */
+    memset(mask, 0, SHALLOC_NUMA_MASK_LONGS*sizeof(unsigned long));
+    file = fopen(SHALLOC_NUMA_ONLINE_PATH, "r");
+    if (file) {
+        while (fscanf(file, "%d", &first) == 1) {
+            last = first;
+            sep = fgetc(file);
+            if (sep == '-') {
+                if (fscanf(file, "%d", &last) != 1) {
+                    break;
+                }
+                sep = fgetc(file);
+            }
+            for (; first <= last && first < SHALLOC_NUMA_MAX_NODES; first++) {
+                mask[first/SHALLOC_NUMA_LONG_BITS] |=
+                    1UL << (first % SHALLOC_NUMA_LONG_BITS);
+                num_nodes = first + 1;
+            }
+            if (sep != ',') {
+                break;
+            }
+        }
+        fclose(file);
+    }
+    if (num_nodes == 0) {
+        mask[0] = 1;
+        num_nodes = 1;
+    }
+    return num_nodes;
+}
+
+int shalloc_numa_bind(void *addr, size_t size, int node)
+{
+    unsigned long mask[SHALLOC_NUMA_MASK_LONGS];
+    int mode, ret;
+
+    if (node == SHALLOC_NUMA_ANY) {
+        return 0;
+    }
+    if (node == SHALLOC_NUMA_INTERLEAVE) {
+        shalloc_numa_get_online(mask);
+        mode = MPOL_INTERLEAVE;
+    }
+    else {
+        memset(mask, 0, sizeof(mask));
+        mask[node/SHALLOC_NUMA_LONG_BITS] =
+            1UL << (node % SHALLOC_NUMA_LONG_BITS);
+        mode = MPOL_BIND;
+    }
+    ret = syscall(SYS_mbind, addr, size, mode, mask,
+        SHALLOC_NUMA_MASK_LONGS*SHALLOC_NUMA_LONG_BITS + 1, 0);
+    return ret < 0 && errno != ENOSYS ? -1 : 0;
+}
+
+/* Shalloc NUMA interface. */
+int shalloc_numa_num_nodes()
+{
+    unsigned long mask[SHALLOC_NUMA_MASK_LONGS];
+
+    return shalloc_numa_get_online(mask);
+}
+
+int shalloc_numa_node()
+{
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+        return 0;
+    }
+    return (int) node;
+}
+
+int shalloc_numa_heaps_create(shalloc_numa_heaps_t *numa_heaps, size_t size,
+    int mmap_flags, enum shalloc_buff_alloc_type type)
+{
+    unsigned long mask[SHALLOC_NUMA_MASK_LONGS];
+    int i, num_nodes;
+
+    /* One heap bound to each online node. */
+    memset(numa_heaps, 0, sizeof(shalloc_numa_heaps_t));
+    num_nodes = shalloc_numa_get_online(mask);
+    for (i = 0; i < num_nodes; i++) {
+        if (!(mask[i/SHALLOC_NUMA_LONG_BITS]
+            & (1UL << (i % SHALLOC_NUMA_LONG_BITS)))) {
+            continue;
+        }
+        numa_heaps->heaps[i] = shalloc_heap_create_on_node(size, mmap_flags,
+            type, i);
+        if (!numa_heaps->heaps[i]) {
+            shalloc_numa_heaps_destroy(numa_heaps);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void shalloc_numa_heaps_destroy(shalloc_numa_heaps_t *numa_heaps)
+{
+    int i;
+
+    for (i = 0; i < SHALLOC_NUMA_MAX_NODES; i++) {
+        if (numa_heaps->heaps[i]) {
+            shalloc_heap_destroy(numa_heaps->heaps[i]);
+            numa_heaps->heaps[i] = NULL;
+        }
+    }
+}
+
+shalloc_heap_t* shalloc_numa_heaps_local(shalloc_numa_heaps_t *numa_heaps)
+{
+    int i, node = shalloc_numa_node();
+
+    /* Fall back to the first heap for nodes without one. */
+    if (node >= 0 && node < SHALLOC_NUMA_MAX_NODES
+        && numa_heaps->heaps[node]) {
+        return numa_heaps->heaps[node];
+    }
+    for (i = 0; i < SHALLOC_NUMA_MAX_NODES; i++) {
+        if (numa_heaps->heaps[i]) {
+            return numa_heaps->heaps[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,155 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+
+#include <errno.h>
+#include <signal.h>
+
+/*
+ * Prefaulting and locking of heap pages. Background prefaulting queues
+ * committed ranges to a single worker thread per process, started on
+ * first use, which populates them with MADV_POPULATE_*. It is best effort:
+ * ranges are dropped while the queue is full, and ranges unmapped in the
+ * meantime simply fail to populate. Pages follow the NUMA policy of their
+ * mapping, whichever thread faults them in.
+ */
+#define SHALLOC_PREFAULT_QUEUE_SIZE     64
+
+typedef struct {
+    void *addr;
+    size_t size;
+    int advice;
+} shalloc_prefault_range_t;
+
+static shalloc_prefault_range_t
+    shalloc_prefault_queue[SHALLOC_PREFAULT_QUEUE_SIZE];
+static int shalloc_prefault_head;
+static int shalloc_prefault_count;
+static pthread_mutex_t shalloc_prefault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shalloc_prefault_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t shalloc_prefault_once = PTHREAD_ONCE_INIT;
+static int shalloc_prefault_started;
+
+/* Prefault utility functions. */
+static void* shalloc_prefault_worker(void *arg)
+{
+    shalloc_prefault_range_t range;
+
+    pthread_mutex_lock(&shalloc_prefault_lock);
+    while (1) {
+        while (!shalloc_prefault_count) {
+            pthread_cond_wait(&shalloc_prefault_cond, &shalloc_prefault_lock);
+        }
+        range = shalloc_prefault_queue[shalloc_prefault_head];
+        shalloc_prefault_head =
+            (shalloc_prefault_head + 1) % SHALLOC_PREFAULT_QUEUE_SIZE;
+        shalloc_prefault_count--;
+        pthread_mutex_unlock(&shalloc_prefault_lock);
+        madvise(range.addr, range.size, range.advice);
+        pthread_mutex_lock(&shalloc_prefault_lock);
+    }
+    return arg;
+}
+
+static void shalloc_prefault_fork_prepare()
+{
+    pthread_mutex_lock(&shalloc_prefault_lock);
+}
+
+static void shalloc_prefault_fork_parent()
+{
+    pthread_mutex_unlock(&shalloc_prefault_lock);
+}
+
+static void shalloc_prefault_fork_child()
+{
+    /*
+     * The worker does not survive fork(), the child starts its own on
+     * first use. Pending ranges belong to the parent, drop them.
+     */
+    pthread_mutex_init(&shalloc_prefault_lock, NULL);
+    pthread_cond_init(&shalloc_prefault_cond, NULL);
+    shalloc_prefault_head = shalloc_prefault_count = 0;
+    shalloc_prefault_started = 0;
+}
+
+static void shalloc_prefault_init()
+{
+    pthread_atfork(shalloc_prefault_fork_prepare,
+        shalloc_prefault_fork_parent, shalloc_prefault_fork_child);
+}
+
+static int shalloc_prefault_start()
+{
+    pthread_t thread;
+    sigset_t set, old_set;
+    int ret;
+
+    /* Called with the queue lock held. */
+    if (shalloc_prefault_started) {
+        return 0;
+    }
+
+    /* Leave signals to the threads of the application. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old_set);
+    ret = pthread_create(&thread, NULL, shalloc_prefault_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (ret != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    shalloc_prefault_started = 1;
+    return 0;
+}
+
+static int shalloc_prefault_enqueue(void *addr, size_t size, int advice)
+{
+    shalloc_prefault_range_t *range;
+
+    pthread_once(&shalloc_prefault_once, shalloc_prefault_init);
+    pthread_mutex_lock(&shalloc_prefault_lock);
+    if (shalloc_prefault_start() < 0) {
+        pthread_mutex_unlock(&shalloc_prefault_lock);
+        return -1;
+    }
+    if (shalloc_prefault_count < SHALLOC_PREFAULT_QUEUE_SIZE) {
+        range = &shalloc_prefault_queue[(shalloc_prefault_head
+            + shalloc_prefault_count) % SHALLOC_PREFAULT_QUEUE_SIZE];
+        range->addr = addr;
+        range->size = size;
+        range->advice = advice;
+        shalloc_prefault_count++;
+        pthread_cond_signal(&shalloc_prefault_cond);
+    }
+    pthread_mutex_unlock(&shalloc_prefault_lock);
+    return 0;
+}
+
+/* Prefault interface. */
+int shalloc_prefault_pages(void *addr, size_t size, int mmap_flags,
+    int prot)
+{
+    int advice = prot & PROT_WRITE ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+    int ret;
+
+    /* Lock first, so pages faulted in later stay locked as well. */
+    if (mmap_flags & MAP_LOCKED) {
+        ret = mmap_flags & MAP_NONBLOCK ? mlock2(addr, size, MLOCK_ONFAULT)
+            : mlock(addr, size);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    if (!(mmap_flags & MAP_POPULATE)) {
+        return 0;
+    }
+    if (mmap_flags & MAP_NONBLOCK) {
+        return shalloc_prefault_enqueue(addr, size, advice);
+    }
+
+    /* Kernels before 5.14 lack MADV_POPULATE_*, pages then fault lazily. */
+    if (madvise(addr, size, advice) < 0 && errno != EINVAL) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,360 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+
+/*
+ * Reverse pointer map of the shadow space. Every SHALLOC_PTRMAP_CHUNK_SIZE
+ * chunk has an entry, either the region owning the whole chunk or, tagged
+ * with the low bit, a table with the owning region of each of its pages.
+ * Page tables live in the private heap and are folded back into a single
+ * entry as soon as all pages of a chunk have the same owner again.
+ *
+ * Region buffers are not page aligned, so the pages at either end of one
+ * are shared with other memory of the parent. Their table entry is tagged
+ * with the low bit as well, and points to the list of buffers overlapping
+ * the page. Pointers in shared pages belong to the innermost buffer they
+ * fall in, or to the owner of the page otherwise.
+ */
+#define SHALLOC_PTRMAP_IS_TABLE(E)      ((E) & 1)
+#define SHALLOC_PTRMAP_TO_TABLE(E)      ((uintptr_t*) ((E) & ~1UL))
+#define SHALLOC_PTRMAP_FROM_TABLE(T)    ((uintptr_t) (T) | 1)
+#define SHALLOC_PTRMAP_IS_SHARED(E)     ((E) & 1)
+#define SHALLOC_PTRMAP_TO_SHARED(E)     ((shalloc_ptrmap_page_t*) ((E) & ~1UL))
+#define SHALLOC_PTRMAP_FROM_SHARED(P)   ((uintptr_t) (P) | 1)
+#define SHALLOC_PTRMAP_CHUNK_PAGES \
+    (SHALLOC_PTRMAP_CHUNK_SIZE/SHALLOC_PAGE_SIZE)
+#define SHALLOC_PTRMAP_PAGE_BUFFS       4
+
+typedef struct {
+    char *start;
+    char *end;
+    shalloc_region_t *region;
+} shalloc_ptrmap_buff_t;
+
+typedef struct {
+    shalloc_region_t *owner;
+    int num_buffs;
+    int max_buffs;
+    shalloc_ptrmap_buff_t buffs[];
+} shalloc_ptrmap_page_t;
+
+/* Pointer map utility functions. */
+static size_t shalloc_ptrmap_index(void *addr)
+{
+    return ((char*) addr - (char*) shalloc_space->base.start)
+        / SHALLOC_PTRMAP_CHUNK_SIZE;
+}
+
+static size_t shalloc_ptrmap_page_index(void *addr)
+{
+    return (((char*) addr - (char*) shalloc_space->base.start)
+        % SHALLOC_PTRMAP_CHUNK_SIZE) / SHALLOC_PAGE_SIZE;
+}
+
+static shalloc_region_t* shalloc_ptrmap_page_owner(uintptr_t entry)
+{
+    if (SHALLOC_PTRMAP_IS_SHARED(entry)) {
+        return SHALLOC_PTRMAP_TO_SHARED(entry)->owner;
+    }
+    return (shalloc_region_t*) entry;
+}
+
+static void shalloc_ptrmap_free_pages(uintptr_t *table, size_t first,
+    size_t last)
+{
+    shalloc_region_t *priv_region;
+    size_t j;
+
+    priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+    for (j = first; j <= last; j++) {
+        if (SHALLOC_PTRMAP_IS_SHARED(table[j])) {
+            shalloc_free(priv_region, SHALLOC_PTRMAP_TO_SHARED(table[j]));
+        }
+    }
+}
+
+static uintptr_t* shalloc_ptrmap_get_table(size_t i)
+{
+    shalloc_region_t *priv_region;
+    uintptr_t entry = shalloc_space->ptr_map[i];
+    uintptr_t *table;
+    size_t j;
+
+    /* Split a uniform chunk into a page table first. */
+    if (SHALLOC_PTRMAP_IS_TABLE(entry)) {
+        return SHALLOC_PTRMAP_TO_TABLE(entry);
+    }
+    priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+    table = shalloc_malloc(priv_region,
+        SHALLOC_PTRMAP_CHUNK_PAGES*sizeof(uintptr_t));
+    if (!table) {
+        return NULL;
+    }
+    for (j = 0; j < SHALLOC_PTRMAP_CHUNK_PAGES; j++) {
+        table[j] = entry;
+    }
+    shalloc_space->ptr_map[i] = SHALLOC_PTRMAP_FROM_TABLE(table);
+    return table;
+}
+
+static void shalloc_ptrmap_fold(size_t i)
+{
+    uintptr_t *table = SHALLOC_PTRMAP_TO_TABLE(shalloc_space->ptr_map[i]);
+    size_t j;
+
+    /* Fold the table back if the chunk has a single owner again. */
+    for (j = 1; j < SHALLOC_PTRMAP_CHUNK_PAGES; j++) {
+        if (table[j] != table[0]) {
+            return;
+        }
+    }
+    shalloc_space->ptr_map[i] = table[0];
+    shalloc_free(shalloc_heap_to_region(shalloc_space->priv_heap), table);
+}
+
+static int shalloc_ptrmap_set_pages(size_t i, size_t first, size_t last,
+    shalloc_region_t *region)
+{
+    uintptr_t *table;
+    size_t j;
+
+    if (shalloc_space->ptr_map[i] == (uintptr_t) region) {
+        return 0;
+    }
+    table = shalloc_ptrmap_get_table(i);
+    if (!table) {
+        return -1;
+    }
+    shalloc_ptrmap_free_pages(table, first, last);
+    for (j = first; j <= last; j++) {
+        table[j] = (uintptr_t) region;
+    }
+    shalloc_ptrmap_fold(i);
+    return 0;
+}
+
+static int shalloc_ptrmap_share_page(char *addr, shalloc_buff_t *buff,
+    shalloc_region_t *region)
+{
+    shalloc_ptrmap_page_t *page, *new_page;
+    shalloc_region_t *priv_region;
+    uintptr_t *table;
+    size_t j = shalloc_ptrmap_page_index(addr);
+    int max_buffs;
+
+    table = shalloc_ptrmap_get_table(shalloc_ptrmap_index(addr));
+    if (!table) {
+        return -1;
+    }
+
+    /* Turn the page into a shared one, or make room for one more buffer. */
+    page = SHALLOC_PTRMAP_IS_SHARED(table[j]) ?
+        SHALLOC_PTRMAP_TO_SHARED(table[j]) : NULL;
+    if (!page || page->num_buffs == page->max_buffs) {
+        max_buffs = page ? 2*page->max_buffs : SHALLOC_PTRMAP_PAGE_BUFFS;
+        priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+        new_page = shalloc_malloc(priv_region, sizeof(shalloc_ptrmap_page_t)
+            + max_buffs*sizeof(shalloc_ptrmap_buff_t));
+        if (!new_page) {
+            shalloc_ptrmap_fold(shalloc_ptrmap_index(addr));
+            return -1;
+        }
+        new_page->owner = shalloc_ptrmap_page_owner(table[j]);
+        new_page->num_buffs = 0;
+        new_page->max_buffs = max_buffs;
+        if (page) {
+            memcpy(new_page->buffs, page->buffs,
+                page->num_buffs*sizeof(shalloc_ptrmap_buff_t));
+            new_page->num_buffs = page->num_buffs;
+            shalloc_free(priv_region, page);
+        }
+        page = new_page;
+        table[j] = SHALLOC_PTRMAP_FROM_SHARED(page);
+    }
+    page->buffs[page->num_buffs].start = buff->start;
+    page->buffs[page->num_buffs].end = buff->end;
+    page->buffs[page->num_buffs].region = region;
+    page->num_buffs++;
+    return 0;
+}
+
+static void shalloc_ptrmap_unshare_page(char *addr, shalloc_buff_t *buff)
+{
+    shalloc_ptrmap_page_t *page;
+    uintptr_t entry = shalloc_space->ptr_map[shalloc_ptrmap_index(addr)];
+    uintptr_t *table;
+    size_t j = shalloc_ptrmap_page_index(addr);
+    int k;
+
+    if (!SHALLOC_PTRMAP_IS_TABLE(entry)) {
+        return;
+    }
+    table = SHALLOC_PTRMAP_TO_TABLE(entry);
+    if (!SHALLOC_PTRMAP_IS_SHARED(table[j])) {
+        return;
+    }
+    page = SHALLOC_PTRMAP_TO_SHARED(table[j]);
+    for (k = 0; k < page->num_buffs; k++) {
+        if (page->buffs[k].start == buff->start) {
+            page->buffs[k] = page->buffs[--page->num_buffs];
+            break;
+        }
+    }
+    if (page->num_buffs == 0) {
+        table[j] = (uintptr_t) page->owner;
+        shalloc_free(shalloc_heap_to_region(shalloc_space->priv_heap), page);
+        shalloc_ptrmap_fold(shalloc_ptrmap_index(addr));
+    }
+}
+
+static char* shalloc_ptrmap_page_start(void *addr)
+{
+    return (char*) ((uintptr_t) addr & ~(SHALLOC_PAGE_SIZE - 1));
+}
+
+int shalloc_ptrmap_set(void *addr, size_t size, shalloc_region_t *region)
+{
+    char *start = (char*) addr, *end = start + size - 1;
+    size_t i, first_i, last_i, first, last;
+    uintptr_t entry;
+
+    assert(size > 0 && (size_t) start % SHALLOC_PAGE_SIZE == 0);
+    assert(SHALLOC_IS_BUFF_ADDR(&shalloc_space->base, start)
+        && SHALLOC_IS_BUFF_ADDR(&shalloc_space->base, end));
+    first_i = shalloc_ptrmap_index(start);
+    last_i = shalloc_ptrmap_index(end);
+    for (i = first_i; i <= last_i; i++) {
+        first = i == first_i ? shalloc_ptrmap_page_index(start) : 0;
+        last = i == last_i ? shalloc_ptrmap_page_index(end) :
+            SHALLOC_PTRMAP_CHUNK_PAGES - 1;
+        entry = shalloc_space->ptr_map[i];
+        if (first == 0 && last == SHALLOC_PTRMAP_CHUNK_PAGES - 1) {
+            if (SHALLOC_PTRMAP_IS_TABLE(entry)) {
+                shalloc_ptrmap_free_pages(SHALLOC_PTRMAP_TO_TABLE(entry), 0,
+                    SHALLOC_PTRMAP_CHUNK_PAGES - 1);
+                shalloc_free(shalloc_heap_to_region(shalloc_space->priv_heap),
+                    SHALLOC_PTRMAP_TO_TABLE(entry));
+            }
+            shalloc_space->ptr_map[i] = (uintptr_t) region;
+        }
+        else if (shalloc_ptrmap_set_pages(i, first, last, region) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int shalloc_ptrmap_add_buff(shalloc_buff_t *buff, shalloc_region_t *region)
+{
+    char *first = shalloc_ptrmap_page_start(buff->start);
+    char *last = shalloc_ptrmap_page_start(buff->end);
+
+    /* Pages the buffer covers in full belong to it alone. */
+    if ((char*) buff->start != first) {
+        if (shalloc_ptrmap_share_page(first, buff, region) < 0) {
+            return -1;
+        }
+        first += SHALLOC_PAGE_SIZE;
+    }
+    if ((char*) buff->end != last + SHALLOC_PAGE_SIZE - 1 && last >= first) {
+        if (shalloc_ptrmap_share_page(last, buff, region) < 0) {
+            shalloc_ptrmap_del_buff(buff, region);
+            return -1;
+        }
+        last -= SHALLOC_PAGE_SIZE;
+    }
+    if (last >= first && shalloc_ptrmap_set(first,
+        last + SHALLOC_PAGE_SIZE - first, region) < 0) {
+        shalloc_ptrmap_del_buff(buff, region);
+        return -1;
+    }
+    return 0;
+}
+
+void shalloc_ptrmap_del_buff(shalloc_buff_t *buff, shalloc_region_t *region)
+{
+    char *first = shalloc_ptrmap_page_start(buff->start);
+    char *last = shalloc_ptrmap_page_start(buff->end);
+
+    /* Hand the pages back to the parent, which they were taken from. */
+    if ((char*) buff->start != first) {
+        shalloc_ptrmap_unshare_page(first, buff);
+        first += SHALLOC_PAGE_SIZE;
+    }
+    if ((char*) buff->end != last + SHALLOC_PAGE_SIZE - 1 && last >= first) {
+        shalloc_ptrmap_unshare_page(last, buff);
+        last -= SHALLOC_PAGE_SIZE;
+    }
+    if (last >= first) {
+        shalloc_ptrmap_set(first, last + SHALLOC_PAGE_SIZE - first,
+            region->parent);
+    }
+}
+
+static shalloc_region_t* shalloc_ptrmap_lookup(void *ptr)
+{
+    shalloc_ptrmap_page_t *page;
+    shalloc_ptrmap_buff_t *buff;
+    uintptr_t entry;
+    int k;
+
+    entry = shalloc_space->ptr_map[shalloc_ptrmap_index(ptr)];
+    if (!SHALLOC_PTRMAP_IS_TABLE(entry)) {
+        return (shalloc_region_t*) entry;
+    }
+    entry = SHALLOC_PTRMAP_TO_TABLE(entry)[shalloc_ptrmap_page_index(ptr)];
+    if (!SHALLOC_PTRMAP_IS_SHARED(entry)) {
+        return (shalloc_region_t*) entry;
+    }
+
+    /* Buffers of nested regions lie within those of their parents. */
+    page = SHALLOC_PTRMAP_TO_SHARED(entry);
+    buff = NULL;
+    for (k = 0; k < page->num_buffs; k++) {
+        if ((char*) ptr >= page->buffs[k].start
+            && (char*) ptr <= page->buffs[k].end
+            && (!buff || page->buffs[k].start > buff->start)) {
+            buff = &page->buffs[k];
+        }
+    }
+    return buff ? buff->region : page->owner;
+}
+
+/* Shalloc pointer lookup interface. */
+shalloc_region_t* shalloc_ptr_to_region(void *ptr)
+{
+    shalloc_region_t *region;
+
+    if (!shalloc_space || !SHALLOC_IS_SPACE_ADDR(ptr)) {
+        return NULL;
+    }
+    region = shalloc_ptrmap_lookup(ptr);
+
+    /* Peers attached to a named space may have created the heap since. */
+    if (!region && SHALLOC_CONTROL_DATA->name[0]
+        && ptr >= shalloc_space->data.start) {
+        shalloc_space_lock();
+        shalloc_space_sync_heaps(0);
+        shalloc_space_unlock();
+        region = shalloc_ptrmap_lookup(ptr);
+    }
+    return region;
+}
+
+shalloc_heap_t* shalloc_ptr_to_heap(void *ptr)
+{
+    shalloc_region_t *region = shalloc_ptr_to_region(ptr);
+
+    while (region && region->parent) {
+        region = region->parent;
+    }
+    return shalloc_region_to_heap(region);
+}
+
+void shalloc_free_any(void *ptr)
+{
+    shalloc_region_t *region = shalloc_ptr_to_region(ptr);
+
+    if (region) {
+        shalloc_free(region, ptr);
+    }
+}
@@ -0,0 +1,249 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+
+/*
+ * Free ranges of the shadow space, kept in an address-ordered array in the
+ * private heap. Adjacent ranges are always coalesced, so the array only
+ * holds the holes left behind by destroyed heaps plus the unused tail.
+ *
+ * Private heaps are carved bottom up and inherit heaps top down, above
+ * the private_end mark in the control pages. The mark covers the private
+ * heaps of every process sharing the space and never goes down, as copies
+ * of private heaps live on in forked children. Callers hold the space lock.
+ */
+#define SHALLOC_RANGE_END(R)    ((R)->start + (R)->size)
+
+/* Range utility functions. */
+static size_t shalloc_range_align_up(size_t addr, size_t align)
+{
+    return (addr + align - 1) & ~(align - 1);
+}
+
+static int shalloc_range_find(char *addr)
+{
+    int lo = 0, hi = shalloc_space->num_free_ranges, mid;
+
+    /* Return the index of the first range starting after addr. */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (shalloc_space->free_ranges[mid].start <= addr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int shalloc_range_insert(int i, char *start, size_t size)
+{
+    shalloc_region_t *priv_region;
+    shalloc_range_t *ranges = shalloc_space->free_ranges;
+    int max_ranges = shalloc_space->max_free_ranges;
+
+    if (shalloc_space->num_free_ranges == max_ranges) {
+        priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+        ranges = shalloc_orealloc(priv_region, ranges,
+            2*max_ranges*sizeof(shalloc_range_t),
+            max_ranges*sizeof(shalloc_range_t));
+        if (!ranges) {
+            return -1;
+        }
+        shalloc_space->free_ranges = ranges;
+        shalloc_space->max_free_ranges = 2*max_ranges;
+    }
+    memmove(&ranges[i+1], &ranges[i],
+        (shalloc_space->num_free_ranges - i)*sizeof(shalloc_range_t));
+    ranges[i].start = start;
+    ranges[i].size = size;
+    shalloc_space->num_free_ranges++;
+
+    return 0;
+}
+
+static void shalloc_range_remove(int i)
+{
+    shalloc_range_t *ranges = shalloc_space->free_ranges;
+
+    shalloc_space->num_free_ranges--;
+    memmove(&ranges[i], &ranges[i+1],
+        (shalloc_space->num_free_ranges - i)*sizeof(shalloc_range_t));
+}
+
+static int shalloc_range_carve(int i, char *start, size_t size)
+{
+    shalloc_range_t *range = &shalloc_space->free_ranges[i];
+    char *end = start + size;
+    size_t front_size = start - range->start;
+    size_t back_size = SHALLOC_RANGE_END(range) - end;
+
+    if (front_size == 0 && back_size == 0) {
+        shalloc_range_remove(i);
+    }
+    else if (front_size == 0) {
+        range->start = end;
+        range->size = back_size;
+    }
+    else if (back_size == 0) {
+        range->size = front_size;
+    }
+    else {
+        if (shalloc_range_insert(i+1, end, back_size) < 0) {
+            return -1;
+        }
+        shalloc_space->free_ranges[i].size = front_size;
+    }
+    shalloc_space->data.unused_size -= size;
+
+    return 0;
+}
+
+static void shalloc_range_set_private_end(char *end)
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+
+    if (magic_info->private_end < end) {
+        magic_info->private_end = end;
+    }
+}
+
+/* Shadow range interface. */
+void shalloc_space_init_ranges()
+{
+    shalloc_region_t *priv_region;
+    shalloc_range_t *ranges;
+
+    priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+    ranges = shalloc_malloc(priv_region,
+        SHALLOC_RANGES_INIT_SIZE*sizeof(shalloc_range_t));
+    assert(ranges && "Out of private heap memory!");
+    ranges[0].start = shalloc_space->data.start;
+    ranges[0].size = shalloc_space->data.size;
+    shalloc_space->free_ranges = ranges;
+    shalloc_space->num_free_ranges = 1;
+    shalloc_space->max_free_ranges = SHALLOC_RANGES_INIT_SIZE;
+    shalloc_space->data.unused_size = shalloc_space->data.size;
+}
+
+void* shalloc_space_alloc_range(size_t size, size_t align, int shared)
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    shalloc_range_t *range;
+    char *start, *floor;
+    int i;
+
+    assert(size > 0 && align > 0 && (align & (align - 1)) == 0);
+    if (!shared) {
+        /* First fit in address order, holes are reused before the tail. */
+        for (i = 0; i < shalloc_space->num_free_ranges; i++) {
+            range = &shalloc_space->free_ranges[i];
+            start = (char*) shalloc_range_align_up((size_t) range->start,
+                align);
+            if (start < SHALLOC_RANGE_END(range)
+                && (size_t)(SHALLOC_RANGE_END(range) - start) >= size) {
+                if (shalloc_range_carve(i, start, size) < 0) {
+                    return NULL;
+                }
+                shalloc_range_set_private_end(start + size);
+                return start;
+            }
+        }
+        return NULL;
+    }
+
+    /* Last fit, never below the private heaps of any process. */
+    for (i = shalloc_space->num_free_ranges - 1; i >= 0; i--) {
+        range = &shalloc_space->free_ranges[i];
+        floor = range->start > magic_info->private_end ? range->start :
+            magic_info->private_end;
+        if (floor >= SHALLOC_RANGE_END(range)
+            || (size_t)(SHALLOC_RANGE_END(range) - floor) < size) {
+            continue;
+        }
+        start = (char*) (((size_t) SHALLOC_RANGE_END(range) - size)
+            & ~(align - 1));
+        if (start >= floor) {
+            return shalloc_range_carve(i, start, size) == 0 ? start : NULL;
+        }
+    }
+    return NULL;
+}
+
+int shalloc_space_reserve_range(void *addr, size_t size, int shared)
+{
+    shalloc_range_t *range;
+    char *start = (char*) addr;
+    int i;
+
+    i = shalloc_range_find(start) - 1;
+    if (i < 0) {
+        return -1;
+    }
+    range = &shalloc_space->free_ranges[i];
+    if (start + size > SHALLOC_RANGE_END(range)
+        || shalloc_range_carve(i, start, size) < 0) {
+        return -1;
+    }
+    if (!shared) {
+        shalloc_range_set_private_end(start + size);
+    }
+    return 0;
+}
+
+void shalloc_space_free_range(void *addr, size_t size)
+{
+    shalloc_range_t *prev, *next;
+    char *start = (char*) addr;
+    int i;
+
+    i = shalloc_range_find(start);
+    prev = i > 0 ? &shalloc_space->free_ranges[i-1] : NULL;
+    next = i < shalloc_space->num_free_ranges ?
+        &shalloc_space->free_ranges[i] : NULL;
+    assert(!prev || SHALLOC_RANGE_END(prev) <= start);
+    assert(!next || start + size <= next->start);
+    shalloc_space->data.unused_size += size;
+
+    /* Coalesce with the neighbors whenever possible. */
+    if (prev && SHALLOC_RANGE_END(prev) == start) {
+        prev->size += size;
+        if (next && SHALLOC_RANGE_END(prev) == next->start) {
+            prev->size += next->size;
+            shalloc_range_remove(i);
+        }
+        return;
+    }
+    if (next && start + size == next->start) {
+        next->start = start;
+        next->size += size;
+        return;
+    }
+
+    /* Out of private heap memory, leak the range. */
+    if (shalloc_range_insert(i, start, size) < 0) {
+        shalloc_space->data.unused_size -= size;
+    }
+}
+
+shalloc_heap_t* shalloc_space_next_heap(shalloc_heap_t *heap)
+{
+    shalloc_range_t *range;
+    char *addr;
+    int i;
+
+    /* Heaps tile the gaps between free ranges, skip to the next gap. */
+    addr = heap ? (char*) heap->base.start + heap->base.size :
+        (char*) shalloc_space->data.start;
+    i = shalloc_range_find(addr);
+    if (i > 0) {
+        range = &shalloc_space->free_ranges[i-1];
+        if (addr < SHALLOC_RANGE_END(range)) {
+            addr = SHALLOC_RANGE_END(range);
+        }
+    }
+    if (addr > (char*) shalloc_space->data.end) {
+        return NULL;
+    }
+    return shalloc_ptr_to_heap(addr);
+}
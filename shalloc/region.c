@@ -6,6 +6,8 @@ static shalloc_buff_t* shalloc_region_alloc_buff(shalloc_region_t *region,
     size_t size)
 {
     shalloc_buff_t *data;
+    char *guard = NULL;
+    size_t chunk_size;
     size_t default_data_size = region->default_data.size;
     if (region->flags & SHALLOC_FLAG(ELASTIC)) {
         default_data_size *= 2;
@@ -14,37 +16,74 @@ static shalloc_buff_t* shalloc_region_alloc_buff(shalloc_region_t *region,
         size = default_data_size;
     }
 
+    /*
+     * The descriptor is part of the buffer size, so buffers of the usual
+     * power of two sizes do not take twice as large blocks of the parent.
+     * Buffers of GUARD regions end at a page boundary, followed by an
+     * inaccessible page. Overflows fault instead of corrupting the parent.
+     */
+    if (size < sizeof(shalloc_buff_t) + SHALLOC_BUFF_MIN_SIZE) {
+        size = sizeof(shalloc_buff_t) + SHALLOC_BUFF_MIN_SIZE;
+    }
+    chunk_size = size;
+    if (region->flags & SHALLOC_FLAG(GUARD)) {
+        chunk_size += 2*SHALLOC_PAGE_SIZE - 1;
+    }
     assert(region->parent);
-    data = (shalloc_buff_t*) shalloc_malloc(region->parent,
-        sizeof(shalloc_buff_t) + size);
+    data = (shalloc_buff_t*) shalloc_malloc(region->parent, chunk_size);
     if (!data) {
         return NULL;
     }
+    size -= sizeof(shalloc_buff_t);
+    if (region->flags & SHALLOC_FLAG(GUARD)) {
+        guard = (char*) (((size_t) (data+1) + size + SHALLOC_PAGE_SIZE - 1)
+            & ~(SHALLOC_PAGE_SIZE - 1));
+        size = guard - (char*)(data+1);
+        if (mprotect(guard, SHALLOC_PAGE_SIZE, PROT_NONE) < 0) {
+            shalloc_free(region->parent, data);
+            return NULL;
+        }
+    }
     shalloc_clone_buff(data, data+1, size, &region->default_data);
     if (data->op->create(data) < 0) {
-        shalloc_free(region->parent, data);
-        return NULL;
+        goto fail;
+    }
+    if (shalloc_ptrmap_add_buff(data, region) < 0) {
+        data->op->destroy(data);
+        goto fail;
     }
     region->default_data.size = default_data_size;
 
     return data;
+
+fail:
+    if (guard) {
+        mprotect(guard, SHALLOC_PAGE_SIZE, PROT_READ|PROT_WRITE);
+    }
+    shalloc_free(region->parent, data);
+    return NULL;
 }
 
 static void shalloc_region_free_buff(shalloc_region_t *region,
     shalloc_buff_t *data)
 {
     data->op->destroy(data);
-    if (region->parent) {
-        shalloc_free(region->parent, data);
+    shalloc_ptrmap_del_buff(data, region);
+    if (region->flags & SHALLOC_FLAG(GUARD)) {
+        mprotect((char*)data->end + 1, SHALLOC_PAGE_SIZE,
+            PROT_READ|PROT_WRITE);
     }
+    shalloc_free(region->parent, data);
 }
 
 static int shalloc_region_grow(shalloc_region_t *region, size_t size)
 {
     shalloc_buff_t *buff;
+    shalloc_heap_t *heap;
     assert(size > 0);
     if (region->data_tail && (region->flags & SHALLOC_FLAG(NON_RESIZABLE))) {
-        return -1;
+        heap = shalloc_region_to_heap(region);
+        return heap ? shalloc_heap_grow(heap, size) : -1;
     }
     buff = shalloc_region_alloc_buff(region, size);
     if (!buff) {
@@ -63,6 +102,33 @@ static int shalloc_region_grow(shalloc_region_t *region, size_t size)
     return 0;
 }
 
+static int shalloc_region_lock(shalloc_region_t *region)
+{
+    shalloc_region_t *owner = region;
+    shalloc_heap_t *heap;
+
+    /* Sub-regions keep their allocator metadata in the owning heap. */
+    if (!(region->flags & SHALLOC_FLAG(HEAP))) {
+        while (owner && !(owner->flags & SHALLOC_FLAG(HEAP))) {
+            owner = owner->parent;
+        }
+        heap = shalloc_region_to_heap(owner);
+        if (heap && (heap->frozen || ((heap->mmap_flags & SHALLOC_MAP_INHERIT)
+            && shalloc_space_sync_thawed() < 0))) {
+            return -1;
+        }
+        return 0;
+    }
+    return shalloc_heap_lock(shalloc_region_to_heap(region));
+}
+
+static void shalloc_region_unlock(shalloc_region_t *region)
+{
+    if (region->flags & SHALLOC_FLAG(HEAP)) {
+        shalloc_heap_unlock(shalloc_region_to_heap(region));
+    }
+}
+
 shalloc_region_t* shalloc_get_region(shalloc_region_t *region,
     shalloc_region_t *parent, size_t buff_size, size_t block_size, int flags,
     enum shalloc_buff_alloc_type type)
@@ -76,6 +142,11 @@ shalloc_region_t* shalloc_get_region(shalloc_region_t *region,
     data = &region->default_data;
     shalloc_get_buff(data, (void*)-1, buff_size, block_size,
         type, SHALLOC_REGION_TYPE_DEFAULT);
+
+    /* Mplite block sizes are only set per heap, see MPLITE_SLOT_SIZE. */
+    if (data->alloc_type == SHALLOC_BUFF_ALLOC_TYPE_MPLITE) {
+        data->block_size = 0;
+    }
     region->data_head = NULL;
     region->data_tail = NULL;
     region->parent = parent;
@@ -114,28 +185,40 @@ shalloc_region_t* shalloc_region_create(shalloc_region_t *parent,
 void shalloc_region_destroy(shalloc_region_t* region)
 {
     shalloc_region_reset(region);
-    if (region->parent) {
-        shalloc_free(region->parent, region);
-    }
     if (region->flags & SHALLOC_FLAG(HEAP)) {
         shalloc_heap_destroy(shalloc_region_to_heap(region));
         return;
     }
+    if (region->data_head) {
+        shalloc_region_free_buff(region, region->data_head);
+    }
+    shalloc_free(region->parent, region);
 }
 
 void shalloc_region_reset(shalloc_region_t* region)
 {
     shalloc_buff_t *prev, *curr;
+    shalloc_heap_t *heap;
+
+    /* Regions within a heap go away with its allocator state. */
+    if (region->flags & SHALLOC_FLAG(HEAP)) {
+        heap = shalloc_region_to_heap(region);
+        shalloc_ptrmap_set(heap->base.start, heap->base.size, region);
+    }
 
     SHALLOC_REGION_BUFF_ITER(region, prev, curr,
         if (prev && prev != region->data_head) {
             shalloc_region_free_buff(region, prev);
         }
     );
-    if (region->data_head) {
+    if (curr && curr != region->data_head) {
+        shalloc_region_free_buff(region, curr);
+    }
+    if (region->data_head && shalloc_region_lock(region) == 0) {
         shalloc_buff_reset(region->data_head);
         region->data_head->next = NULL;
         region->data_tail = region->data_head;
+        shalloc_region_unlock(region);
     }
 }
 
@@ -154,13 +237,31 @@ void shalloc_region_get_info(shalloc_region_t* region,
     }
 }
 
-void* shalloc_malloc(shalloc_region_t *region, size_t size)
+int shalloc_region_get_usage(shalloc_region_t* region,
+    shalloc_usage_t *usage)
+{
+    shalloc_buff_t *prev, *curr;
+    shalloc_heap_t *heap;
+
+    if (region->flags & SHALLOC_FLAG(HEAP)) {
+        return shalloc_heap_get_usage(shalloc_region_to_heap(region), usage);
+    }
+    memset(usage, 0, sizeof(shalloc_usage_t));
+    SHALLOC_REGION_BUFF_ITER(region, prev, curr,
+        heap = shalloc_ptr_to_heap(curr->start);
+        if (shalloc_usage_add(curr->start, curr->size,
+            heap && (heap->mmap_flags & SHALLOC_MAP_FILE), usage) < 0) {
+            return -1;
+        }
+    );
+    (void) prev;
+    return 0;
+}
+
+static void* shalloc_region_malloc(shalloc_region_t *region, size_t size)
 {
     void *ptr;
     shalloc_buff_t *data_tail = region->data_tail;
-    if (!size) {
-        return NULL;
-    }
     ptr = NULL;
     if (data_tail) {
         ptr = data_tail->op->malloc(data_tail, size);
@@ -174,34 +275,41 @@ void* shalloc_malloc(shalloc_region_t *region, size_t size)
     return ptr;
 }
 
-void shalloc_free(shalloc_region_t *region, void *ptr)
+static void shalloc_region_free(shalloc_region_t *region, void *ptr)
 {
+    shalloc_buff_t *prev, *curr;
     shalloc_buff_t *data_tail = region->data_tail;
-    if (!ptr) {
-        return;
-    }
 
-    /* We only support deallocation in the last data buffer. */
+    /*
+     * Most frees hit the last data buffer. Memory freed in older buffers
+     * is returned to their allocator, but only the last one serves new
+     * allocations.
+     */
     if (data_tail && SHALLOC_IS_BUFF_ADDR(data_tail, ptr)) {
         data_tail->op->free(data_tail, ptr);
+        return;
     }
+    SHALLOC_REGION_BUFF_ITER(region, prev, curr,
+        if (SHALLOC_IS_BUFF_ADDR(curr, ptr)) {
+            curr->op->free(curr, ptr);
+            return;
+        }
+    );
+    (void) prev;
 }
 
-void* shalloc_calloc(shalloc_region_t *region, size_t nmemb, size_t size)
+static void* shalloc_region_calloc(shalloc_region_t *region, size_t nmemb,
+    size_t size)
 {
     void *ptr;
     shalloc_buff_t *data_tail = region->data_tail;
-    size_t tot_size = nmemb*size;
-    if (tot_size == 0) {
-        return NULL;
-    }
     ptr = NULL;
     if (data_tail) {
         ptr = data_tail->op->calloc(data_tail, nmemb, size);
     }
     if (!ptr) {
         if (shalloc_region_grow(region,
-            SHALLOC_BUFF_ALLOC_SIZE(tot_size)) == 0) {
+            SHALLOC_BUFF_ALLOC_SIZE(nmemb*size)) == 0) {
             data_tail = region->data_tail;
             ptr = data_tail->op->calloc(data_tail, nmemb, size);
         }
@@ -209,6 +317,37 @@ void* shalloc_calloc(shalloc_region_t *region, size_t nmemb, size_t size)
     return ptr;
 }
 
+void* shalloc_malloc(shalloc_region_t *region, size_t size)
+{
+    void *ptr;
+    if (!size || shalloc_region_lock(region) < 0) {
+        return NULL;
+    }
+    ptr = shalloc_region_malloc(region, size);
+    shalloc_region_unlock(region);
+    return ptr;
+}
+
+void shalloc_free(shalloc_region_t *region, void *ptr)
+{
+    if (!ptr || shalloc_region_lock(region) < 0) {
+        return;
+    }
+    shalloc_region_free(region, ptr);
+    shalloc_region_unlock(region);
+}
+
+void* shalloc_calloc(shalloc_region_t *region, size_t nmemb, size_t size)
+{
+    void *ptr;
+    if (nmemb*size == 0 || shalloc_region_lock(region) < 0) {
+        return NULL;
+    }
+    ptr = shalloc_region_calloc(region, nmemb, size);
+    shalloc_region_unlock(region);
+    return ptr;
+}
+
 void* shalloc_orealloc(shalloc_region_t *region, void *ptr, size_t size,
     size_t old_size)
 {
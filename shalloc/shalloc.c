@@ -1,6 +1,10 @@
 #include <shalloc/shalloc.h>
 #include "include/util.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 shalloc_space_t *shalloc_space = NULL;
 
 /* Generic allocator functions. */
@@ -18,6 +22,13 @@ void gen_empty_destroy(void *ref)
 {
 }
 
+int gen_empty_extend(void *ref, size_t size)
+{
+    (void) ref;
+    (void) size;
+    return 0;
+}
+
 /* Utility functions. */
 void shalloc_map_fixed_pages(void *addr, size_t size, int prot,
     int mmap_flags)
@@ -26,18 +37,230 @@ void shalloc_map_fixed_pages(void *addr, size_t size, int prot,
     assert(addr == real_addr);
 }
 
-void shalloc_space_new_heap(shalloc_heap_t *heap)
+int shalloc_commit_pages(void *addr, size_t size, int mmap_flags)
 {
-    if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
-        assert(!shalloc_space->has_noninherit_heaps && "Inherit heaps should always be created first!");
+    void *real_addr = mmap(addr, size, PROT_READ|PROT_WRITE,
+        (mmap_flags & ~(SHALLOC_MAP_PSEUDO_FLAGS|SHALLOC_MAP_PREFAULT_MASK))
+        |MAP_FIXED, -1, 0);
+    if (real_addr != addr) {
+        return -1;
+    }
+    if (mmap_flags & SHALLOC_MAP_HUGEPAGE) {
+        madvise(addr, size, MADV_HUGEPAGE);
     }
-    else {
-        shalloc_space->has_noninherit_heaps = 1;
+    return 0;
+}
+
+void shalloc_decommit_pages(void *addr, size_t size)
+{
+    shalloc_map_fixed_pages(addr, size, PROT_NONE,
+        SHALLOC_RESERVE_MMAP_FLAGS);
+}
+
+int shalloc_fork_policy_pages(void *addr, size_t size, int old_mmap_flags,
+    int mmap_flags)
+{
+    int changed = (old_mmap_flags ^ mmap_flags) & SHALLOC_MAP_FORK_MASK;
+
+    if ((changed & SHALLOC_MAP_DONTFORK) && madvise(addr, size,
+        mmap_flags & SHALLOC_MAP_DONTFORK ? MADV_DONTFORK : MADV_DOFORK) < 0) {
+        return -1;
+    }
+    if (changed & SHALLOC_MAP_WIPEONFORK) {
+#ifdef MADV_WIPEONFORK
+        return madvise(addr, size, mmap_flags & SHALLOC_MAP_WIPEONFORK ?
+            MADV_WIPEONFORK : MADV_KEEPONFORK);
+#else
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+static shalloc_inherit_slot_t* shalloc_space_get_slot(shalloc_heap_t *heap)
+{
+    shalloc_region_t *priv_region;
+    shalloc_inherit_slot_t *slots = shalloc_space->inherit_slots;
+    int i = heap - SHALLOC_CONTROL_DATA->heap_list;
+    int max_slots = shalloc_space->max_inherit_slots;
+
+    /* Follow the size of the table. */
+    if (i >= max_slots) {
+        priv_region = shalloc_heap_to_region(shalloc_space->priv_heap);
+        max_slots = SHALLOC_CONTROL_DATA->max_heaps;
+        slots = shalloc_orealloc(priv_region, slots,
+            max_slots*sizeof(shalloc_inherit_slot_t),
+            shalloc_space->max_inherit_slots*sizeof(shalloc_inherit_slot_t));
+        if (!slots) {
+            return NULL;
+        }
+        memset(&slots[shalloc_space->max_inherit_slots], 0,
+            (max_slots - shalloc_space->max_inherit_slots)
+            *sizeof(shalloc_inherit_slot_t));
+        shalloc_space->inherit_slots = slots;
+        shalloc_space->max_inherit_slots = max_slots;
     }
+    return &slots[i];
+}
 
-    assert(shalloc_space->data.unused_size >= heap->base.size);
-    shalloc_space->data.unused_size -= heap->base.size;
+int shalloc_space_new_heap(shalloc_heap_t *heap)
+{
+    shalloc_inherit_slot_t *slot = NULL;
+
+    assert(heap->base.start && heap->base.size > 0);
+    if ((heap->mmap_flags & SHALLOC_MAP_INHERIT)
+        && !(slot = shalloc_space_get_slot(heap))) {
+        return -1;
+    }
+    if (shalloc_ptrmap_set(heap->base.start, heap->base.size,
+        &heap->region) < 0) {
+        return -1;
+    }
+    if (slot) {
+        slot->start = heap->base.start;
+        slot->size = heap->base.size;
+        slot->gen = heap->gen;
+        slot->mapped = 1;
+        slot->fd = heap->inherit_id >= 0 ? heap->inherit_id : -1;
+    }
     shalloc_space->num_heaps++;
+    return 0;
+}
+
+void shalloc_space_del_heap(shalloc_heap_t *heap)
+{
+    shalloc_ptrmap_set(heap->base.start, heap->base.size, NULL);
+    if (heap->mmap_flags & SHALLOC_MAP_INHERIT) {
+        shalloc_space_get_slot(heap)->gen = 0;
+    }
+    shalloc_space->num_heaps--;
+}
+
+static void shalloc_space_drop_slot(shalloc_inherit_slot_t *slot)
+{
+    /* A peer destroyed the heap, drop our mapping and reservation. */
+    if (slot->mapped) {
+        shalloc_ptrmap_set(slot->start, slot->size, NULL);
+        shalloc_decommit_pages(slot->start, slot->size);
+        shalloc_space->num_heaps--;
+    }
+    if (slot->fd != -1) {
+        shalloc_shm_close(slot->fd);
+    }
+    shalloc_space_free_range(slot->start, slot->size);
+    slot->gen = 0;
+}
+
+void shalloc_space_sync_heaps(int map_all)
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    shalloc_inherit_slot_t *slot;
+    shalloc_heap_t *heap;
+    int i;
+
+    for (i = 0; i < shalloc_space->max_inherit_slots; i++) {
+        slot = &shalloc_space->inherit_slots[i];
+        heap = &magic_info->heap_list[i];
+        if (slot->gen && (!heap->base.start || heap->gen != slot->gen)) {
+            shalloc_space_drop_slot(slot);
+        }
+    }
+
+    /*
+     * Reserve the heaps other processes created since, and map those we
+     * can open: named heaps, or any heap when its fd was inherited.
+     */
+    for (i = 0; i < magic_info->num_heaps; i++) {
+        heap = &magic_info->heap_list[i];
+        if (!heap->base.start || i == magic_info->new_slot
+            || (i < shalloc_space->max_inherit_slots
+            && shalloc_space->inherit_slots[i].gen == heap->gen)) {
+            continue;
+        }
+        slot = shalloc_space_get_slot(heap);
+        if (!slot || shalloc_space_reserve_range(heap->base.start,
+            heap->base.size, 1) < 0) {
+            continue;
+        }
+        if ((map_all || heap->inherit_id == SHALLOC_HEAP_NAMED)
+            && shalloc_map_heap(heap) == 0
+            && shalloc_space_new_heap(heap) == 0) {
+            continue;
+        }
+        shalloc_decommit_pages(heap->base.start, heap->base.size);
+        slot->start = heap->base.start;
+        slot->size = heap->base.size;
+        slot->gen = heap->gen;
+        slot->mapped = 0;
+        slot->fd = -1;
+    }
+}
+
+void shalloc_space_init_lock(shalloc_magic_t *magic_info)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&magic_info->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    magic_info->new_slot = -1;
+}
+
+void shalloc_space_lock()
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    shalloc_heap_t *heap;
+    int ret;
+
+    ret = pthread_mutex_lock(&magic_info->lock);
+    if (ret == EOWNERDEAD) {
+        /*
+         * The owner died holding the lock. Slots and ranges are claimed
+         * in one go, only the heap it was creating may be half done.
+         */
+        if (magic_info->new_slot != -1) {
+            heap = &magic_info->heap_list[magic_info->new_slot];
+            if (heap->inherit_id == SHALLOC_HEAP_NAMED) {
+                shalloc_shm_unlink_named(magic_info->name,
+                    magic_info->new_slot);
+            }
+            heap->base.start = NULL;
+            magic_info->new_slot = -1;
+        }
+        pthread_mutex_consistent(&magic_info->lock);
+        ret = 0;
+    }
+    assert(ret == 0);
+}
+
+void shalloc_space_unlock()
+{
+    pthread_mutex_unlock(&SHALLOC_CONTROL_DATA->lock);
+}
+
+int shalloc_space_grow_inherit_table()
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    size_t table_size = magic_info->table_size;
+    size_t new_table_size = 2*table_size;
+
+    if (new_table_size > SHALLOC_INHERIT_TABLE_MAX_SIZE) {
+        new_table_size = SHALLOC_INHERIT_TABLE_MAX_SIZE;
+    }
+    if (new_table_size == table_size) {
+        return -1;
+    }
+
+    /*
+     * Every process maps the whole table range, so the new tail is already
+     * visible to all of them and only gets populated as it is written.
+     */
+    magic_info->table_size = new_table_size;
+    magic_info->max_heaps = new_table_size/sizeof(shalloc_heap_t);
+
+    return 0;
 }
 
 /* Printing functions. */
@@ -61,6 +284,7 @@ void shalloc_buff_print(shalloc_buff_t *buff)
     shalloc_printf(" .start=%p", (void*) buff->start);
     shalloc_printf(" .end=%p", (void*) buff->end);
     shalloc_printf(" .size=%zu", buff->size);
+    shalloc_printf(" .max_size=%zu", buff->max_size);
     shalloc_printf(" .unused_size=%zu", buff->unused_size);
     shalloc_printf(" .next=%p", (void*) buff->next);
     shalloc_printf(" }");
@@ -74,6 +298,7 @@ void shalloc_heap_print(shalloc_heap_t *heap)
     shalloc_printf(" .region=");
     shalloc_region_print(&heap->region);
     shalloc_printf(" .mmap_flags=0x%08x", heap->mmap_flags);
+    shalloc_printf(" .numa_node=%d", heap->numa_node);
     shalloc_printf(" }");
 }
 
@@ -89,43 +314,142 @@ void shalloc_region_print(shalloc_region_t *region)
     shalloc_printf(" }");
 }
 
-/* Shalloc allocator interface. */
-void shalloc_space_init()
+static size_t shalloc_parse_size(const char *str)
+{
+    char *end;
+    size_t size = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'T': case 't':
+        size <<= 10;
+        /* fall through */
+    case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+    default:
+        break;
+    }
+    return size;
+}
+
+static void shalloc_space_get_config(char **base_addr, size_t *size)
+{
+    char *env;
+
+    /*
+     * Explicit values first, then the environment, then the defaults.
+     * Inheriting children always follow the layout exported by the parent.
+     */
+    if (getenv(SHALLOC_INHERIT_ID) != NULL
+        || getenv(SHALLOC_SPACE_NAME_ENV) != NULL) {
+        *base_addr = NULL;
+        *size = 0;
+    }
+    if (!*base_addr && (env = getenv(SHALLOC_BASE_ADDR_ENV)) != NULL) {
+        *base_addr = (char*) strtoull(env, NULL, 0);
+    }
+    if (!*base_addr) {
+        *base_addr = (char*) SHALLOC_BASE_ADDR;
+    }
+    if (!*size && (env = getenv(SHALLOC_SPACE_SIZE_ENV)) != NULL) {
+        *size = shalloc_parse_size(env);
+    }
+    if (!*size) {
+        *size = SHALLOC_BASE_SIZE;
+    }
+
+    /*
+     * Consume the overrides so unrelated children do not try to claim the
+     * same range. Inheriting children get them back via the exec envp.
+     */
+    unsetenv(SHALLOC_BASE_ADDR_ENV);
+    unsetenv(SHALLOC_SPACE_SIZE_ENV);
+}
+
+char* shalloc_space_reserve(char *base_addr, size_t size)
+{
+    char *addr;
+    int mmap_flags = SHALLOC_RESERVE_MMAP_FLAGS;
+
+    /* Never clobber existing mappings when reserving the shadow space. */
+#ifdef MAP_FIXED_NOREPLACE
+    mmap_flags |= MAP_FIXED_NOREPLACE;
+#endif
+    addr = mmap(base_addr, size, PROT_NONE, mmap_flags, -1, 0);
+    if (addr != MAP_FAILED && addr != base_addr) {
+        munmap(addr, size);
+        addr = MAP_FAILED;
+    }
+    return addr;
+}
+
+static int shalloc_space_valid_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 0 && len < SHALLOC_SPACE_NAME_MAX && !strchr(name, '/');
+}
+
+static int shalloc_space_get_inherit_id()
+{
+    char *env;
+    int inherit_mem_id = -1;
+
+    /* Children of named spaces attach by name, others inherit the fd. */
+    if ((env = getenv(SHALLOC_SPACE_NAME_ENV)) != NULL) {
+        if (shalloc_space_valid_name(env)) {
+            inherit_mem_id = shalloc_shm_open_named(env, -1, 0, 0);
+        }
+        assert(inherit_mem_id != -1 && "Named shadow space not found!");
+        unsetenv(SHALLOC_SPACE_NAME_ENV);
+    }
+    else if ((env = getenv(SHALLOC_INHERIT_ID)) != NULL) {
+        inherit_mem_id = atoi(env);
+        unsetenv(SHALLOC_INHERIT_ID);
+    }
+    return inherit_mem_id;
+}
+
+static int shalloc_space_init_with(char *base_addr, size_t size,
+    int inherit_mem_id)
 {
-    char *base_addr, *addr;
-    int ret, i;
+    char *addr;
+    int ret;
     shalloc_heap_t heap, *priv_heap;
     shalloc_buff_t *buff;
     shalloc_region_t *priv_region;
     shalloc_magic_t *magic_info;
-    int inherit_mem_id;
-    char *inherit_mem_ptr;
-
-    if (shalloc_space) {
-        return;
-    }
 
     /* Check configuration. */
-    assert(SHALLOC_BASE_SIZE >= 3*SHALLOC_PRIVATE_HEAP_SIZE);
+    assert((size_t) base_addr % SHALLOC_PAGE_SIZE == 0);
+    assert(size % SHALLOC_PAGE_SIZE == 0);
+    assert(size >= 3*SHALLOC_PRIVATE_HEAP_MAX_SIZE + SHALLOC_MAGIC_PAGES_SIZE
+        + SHALLOC_INHERIT_TABLE_MAX_SIZE + SHALLOC_PTRMAP_SIZE(size));
     assert(SHALLOC_DEFAULT_MMAP_FLAGS != 0);
 
     /* Map (and reserve) shadow space memory. */
-    base_addr=mmap((void*)SHALLOC_BASE_ADDR, SHALLOC_BASE_SIZE,
-        PROT_READ|PROT_WRITE, SHALLOC_DEFAULT_MMAP_FLAGS|MAP_FIXED, -1, 0);
-    assert(base_addr != MAP_FAILED);
+    base_addr = shalloc_space_reserve(base_addr, size);
+    if (base_addr == MAP_FAILED) {
+        return -1;
+    }
     addr = base_addr;
 
 #if SHALLOC_USE_GUARD_PAGES
-    /* Map first guard page. */
-    shalloc_map_fixed_pages(addr, SHALLOC_PAGE_SIZE, PROT_NONE,
-        MAP_ANONYMOUS|MAP_PRIVATE);
+    /* Leave the first guard page reserved. */
     addr += SHALLOC_PAGE_SIZE;
 #endif
 
     /* Create private heap for our own data structures. */
     shalloc_get_heap(&heap, addr, SHALLOC_PRIVATE_HEAP_SIZE,
-        MAP_ANONYMOUS|MAP_PRIVATE, 0);
-    shalloc_map_heap(&heap);
+        SHALLOC_PRIVATE_HEAP_MAX_SIZE,
+        MAP_ANONYMOUS|MAP_PRIVATE|SHALLOC_MAP_GROWABLE, 0);
+    ret = shalloc_map_heap(&heap);
+    assert(ret == 0);
     buff = shalloc_heap_to_buff(&heap);
     buff->op = &shalloc_space_buff_ops[SHALLOC_HEAP_TYPE_DEFAULT];
     ret = buff->op->create(buff);
@@ -140,53 +464,74 @@ void shalloc_space_init()
     addr += priv_heap->base.size;
 
     /* Create inherited magic pages. */
-    if (getenv(SHALLOC_INHERIT_ID) == NULL) {
-        inherit_mem_id = shmget(IPC_PRIVATE, 2*SHALLOC_PAGE_SIZE, SHM_R | SHM_W);
+    if (inherit_mem_id == -1) {
+        inherit_mem_id = shalloc_shm_create(SHALLOC_MAGIC_PAGES_SIZE
+            + SHALLOC_INHERIT_TABLE_MAX_SIZE, 0);
         assert(inherit_mem_id != -1);
-        inherit_mem_ptr = shmat(inherit_mem_id, addr, SHM_REMAP);
-        assert(inherit_mem_ptr != MAP_FAILED);
+        ret = shalloc_shm_map(inherit_mem_id, addr, SHALLOC_MAGIC_PAGES_SIZE
+            + SHALLOC_INHERIT_TABLE_MAX_SIZE, 0, PROT_READ|PROT_WRITE);
+        assert(ret == 0);
 
-        // mark for delete
-        shmctl(inherit_mem_id, IPC_RMID, NULL);
-
-        magic_info = (shalloc_magic_t *) inherit_mem_ptr;
+        magic_info = (shalloc_magic_t *) addr;
         magic_info->inherit_id = inherit_mem_id;
         sprintf(magic_info->inherit_envp_buff, "%s=%d",
             SHALLOC_INHERIT_ID, inherit_mem_id);
+        sprintf(magic_info->base_envp_buff, "%s=%p",
+            SHALLOC_BASE_ADDR_ENV, (void*) base_addr);
+        sprintf(magic_info->size_envp_buff, "%s=%zu",
+            SHALLOC_SPACE_SIZE_ENV, size);
         magic_info->inherit_envp[0] = magic_info->inherit_envp_buff;
-        magic_info->inherit_envp[1] = NULL;
+        magic_info->inherit_envp[1] = magic_info->base_envp_buff;
+        magic_info->inherit_envp[2] = magic_info->size_envp_buff;
+        magic_info->inherit_envp[3] = NULL;
+        magic_info->name[0] = '\0';
+        magic_info->base_addr = base_addr;
+        magic_info->size = size;
         magic_info->num_heaps = 0;
+        magic_info->table_size = SHALLOC_PAGE_SIZE;
+        magic_info->thaw_gen = 0;
+        magic_info->private_end = NULL;
+        shalloc_space_init_lock(magic_info);
+        magic_info->max_heaps = SHALLOC_PAGE_SIZE/sizeof(shalloc_heap_t);
+        magic_info->heap_list =
+            (shalloc_heap_t*) (addr + SHALLOC_MAGIC_PAGES_SIZE);
     } else {
-        inherit_mem_ptr = shmat(atoi(getenv(SHALLOC_INHERIT_ID)), addr, SHM_REMAP); //TODO:
-        assert(inherit_mem_ptr != MAP_FAILED);
-        unsetenv(SHALLOC_INHERIT_ID);
-
-        magic_info = (shalloc_magic_t *) inherit_mem_ptr;
-        for (i = 0; i < magic_info->num_heaps; i++) {
-            shalloc_heap_t inherit_heap = magic_info->heap_list[i];
-            shalloc_buff_t *data = shalloc_heap_to_buff(&inherit_heap);
-            inherit_mem_ptr = shmat(inherit_heap.inherit_id, data->start, SHM_REMAP);
-            assert(inherit_mem_ptr != MAP_FAILED);
-        }
+        /* Map the magic pages and the whole heap table in one go. */
+        ret = shalloc_shm_map(inherit_mem_id, addr, SHALLOC_MAGIC_PAGES_SIZE
+            + SHALLOC_INHERIT_TABLE_MAX_SIZE, 0, PROT_READ|PROT_WRITE);
+        assert(ret == 0);
+        magic_info = (shalloc_magic_t *) addr;
     }
 
     /* Initialize shalloc space. */
     shalloc_space = shalloc_malloc(priv_region, sizeof(shalloc_space_t));
     assert(shalloc_space);
     buff = &shalloc_space->base;
-    shalloc_get_buff(buff, base_addr, SHALLOC_BASE_SIZE, 0, 0, 0);
+    shalloc_get_buff(buff, base_addr, size, 0, 0, 0);
 
     shalloc_space->magic_control_page = addr;
     shalloc_space->magic_inherit_page = addr + SHALLOC_PAGE_SIZE;
-    addr += 2*SHALLOC_PAGE_SIZE;
+    addr += SHALLOC_MAGIC_PAGES_SIZE + SHALLOC_INHERIT_TABLE_MAX_SIZE;
+
+    /* Commit the pointer map, only touched pages are ever populated. */
+    ret = shalloc_commit_pages(addr, SHALLOC_PTRMAP_SIZE(size),
+        MAP_ANONYMOUS|MAP_PRIVATE|MAP_NORESERVE);
+    assert(ret == 0);
+    shalloc_space->ptr_map = (uintptr_t*) addr;
+    addr += SHALLOC_PTRMAP_SIZE(size);
 
     buff = &shalloc_space->data;
     shalloc_get_buff(buff, addr,
         (char*)shalloc_space->base.end - (char*)addr + 1, 0, 0, 0);
     shalloc_space->mmap_flags = SHALLOC_DEFAULT_MMAP_FLAGS;
     shalloc_space->num_heaps = 0;
-    shalloc_space->has_noninherit_heaps = 0;
+    shalloc_space->inherit_slots = NULL;
+    shalloc_space->max_inherit_slots = 0;
+    shalloc_space->free_heap_descs = NULL;
     shalloc_space->priv_heap = priv_heap;
+    shalloc_space->control_fd = inherit_mem_id;
+    shalloc_space->thaw_gen = magic_info->thaw_gen;
+    shalloc_space->ckpt_id = 0;
     memcpy(shalloc_space->buff_ops, shalloc_space_buff_ops,
         sizeof(shalloc_buff_op_t)*__NUM_SHALLOC_BUFF_ALLOC_TYPES);
 
@@ -194,32 +539,155 @@ void shalloc_space_init()
     buff = shalloc_heap_to_buff(priv_heap);
     buff->op = &shalloc_space->buff_ops[SHALLOC_HEAP_TYPE_DEFAULT];
 
-    /* Update shalloc space size information when inheriting heaps. */
+    /* Map inherited heaps, carved out of the free ranges. */
+    shalloc_space_init_ranges();
+    shalloc_space_lock();
+    shalloc_space_sync_heaps(1);
+    shalloc_space_unlock();
+
+    return 0;
+}
+
+/* Shalloc allocator interface. */
+void shalloc_space_init()
+{
+    shalloc_space_init_at(NULL, 0);
+}
+
+void shalloc_space_init_at(void *base, size_t size)
+{
+    char *base_addr = (char*) base;
+    int ret;
+
+    if (shalloc_space) {
+        return;
+    }
+    shalloc_space_get_config(&base_addr, &size);
+    ret = shalloc_space_init_with(base_addr, size,
+        shalloc_space_get_inherit_id());
+    assert(ret == 0 && "Shadow space address range in use!");
+}
+
+int shalloc_space_publish(const char *name)
+{
+    shalloc_magic_t *magic_info = SHALLOC_CONTROL_DATA;
+    size_t size = SHALLOC_MAGIC_PAGES_SIZE + magic_info->table_size;
+    int i, fd;
+
+    assert(shalloc_space && "shalloc_space not initialized");
+    if (!shalloc_space_valid_name(name) || magic_info->name[0]) {
+        return -1;
+    }
+
+    /* Inherit heaps are named at creation, publish before any exists. */
     for (i = 0; i < magic_info->num_heaps; i++) {
-        shalloc_heap_t *inherit_heap = &magic_info->heap_list[i];
-        shalloc_space_new_heap(inherit_heap);
+        if (magic_info->heap_list[i].base.start) {
+            return -1;
+        }
+    }
+    fd = shalloc_shm_open_named(name, -1, O_CREAT|O_EXCL,
+        SHALLOC_MAGIC_PAGES_SIZE + SHALLOC_INHERIT_TABLE_MAX_SIZE);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* Move the control pages to the named segment, in place. */
+    strcpy(magic_info->name, name);
+    sprintf(magic_info->inherit_envp_buff, "%s=%s",
+        SHALLOC_SPACE_NAME_ENV, name);
+    magic_info->inherit_id = fd;
+    if (pwrite(fd, magic_info, size, 0) != (ssize_t) size
+        || shalloc_shm_map(fd, magic_info, SHALLOC_MAGIC_PAGES_SIZE
+        + SHALLOC_INHERIT_TABLE_MAX_SIZE, 0, PROT_READ|PROT_WRITE) < 0) {
+        magic_info->name[0] = '\0';
+        magic_info->inherit_id = shalloc_space->control_fd;
+        sprintf(magic_info->inherit_envp_buff, "%s=%d",
+            SHALLOC_INHERIT_ID, shalloc_space->control_fd);
+        shalloc_shm_close(fd);
+        shalloc_shm_unlink_named(name, -1);
+        return -1;
     }
+    shalloc_shm_close(shalloc_space->control_fd);
+    shalloc_space->control_fd = fd;
+
+    return 0;
 }
 
-void shalloc_space_close()
+int shalloc_space_attach(const char *name)
+{
+    shalloc_magic_t magic_info;
+    int fd;
+
+    if (shalloc_space || !shalloc_space_valid_name(name)) {
+        return -1;
+    }
+    fd = shalloc_shm_open_named(name, -1, 0, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* The space goes at the same address, all pointers remain valid. */
+    if (pread(fd, &magic_info, sizeof(magic_info), 0) != sizeof(magic_info)
+        || strcmp(magic_info.name, name)
+        || shalloc_space_init_with(magic_info.base_addr, magic_info.size,
+        fd) < 0) {
+        shalloc_shm_close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+void shalloc_space_unlink(const char *name)
 {
-    int i, inherit_id;
     shalloc_magic_t *magic_info;
+    shalloc_heap_t *heap_list;
+    size_t size;
+    int i, fd;
+
+    if (!shalloc_space_valid_name(name)) {
+        return;
+    }
+    fd = shalloc_shm_open_named(name, -1, 0, 0);
+    if (fd < 0) {
+        return;
+    }
+
+    /* Drop the segments of inherit heaps, then the control pages. */
+    size = shalloc_shm_get_size(fd);
+    magic_info = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (magic_info != MAP_FAILED) {
+        heap_list = (shalloc_heap_t*)
+            ((char*) magic_info + SHALLOC_MAGIC_PAGES_SIZE);
+        for (i = 0; i < magic_info->num_heaps && (i + 1)*sizeof(shalloc_heap_t)
+            <= size - SHALLOC_MAGIC_PAGES_SIZE; i++) {
+            if (heap_list[i].base.start
+                && heap_list[i].inherit_id == SHALLOC_HEAP_NAMED) {
+                shalloc_shm_unlink_named(name, i);
+            }
+        }
+        munmap(magic_info, size);
+    }
+    shalloc_shm_close(fd);
+    shalloc_shm_unlink_named(name, -1);
+}
+
+void shalloc_space_close()
+{
+    shalloc_inherit_slot_t *slot;
+    int i;
 
     if (!shalloc_space) {
         return;
     }
 
-    magic_info = (shalloc_magic_t *)shalloc_space->magic_control_page;
-    for (i = 0; i < magic_info->num_heaps; i++) {
-        shalloc_heap_t inherit_heap = magic_info->heap_list[i];
-        shalloc_buff_t *data = shalloc_heap_to_buff(&inherit_heap);
-        shmdt(data->start);
-        shmctl(inherit_heap.inherit_id, IPC_RMID, NULL);
+    /* Only close the memfds of inherit heaps mapped here. */
+    for (i = 0; i < shalloc_space->max_inherit_slots; i++) {
+        slot = &shalloc_space->inherit_slots[i];
+        if (slot->gen && slot->fd != -1) {
+            shalloc_shm_close(slot->fd);
+        }
     }
-    inherit_id = magic_info->inherit_id;
-    shmdt(shalloc_space->magic_control_page);
-    shmctl(inherit_id, IPC_RMID, NULL);
+    shalloc_shm_close(shalloc_space->control_fd);
 
     munmap(shalloc_space->base.start, shalloc_space->base.size);
     shalloc_space = NULL;
@@ -228,8 +696,8 @@ void shalloc_space_close()
 void shalloc_space_freeze()
 {
     /* Freeze shalloc space. No more heaps can be create/modified from now on.*/
-    int ret = mprotect(shalloc_space->priv_heap->base.start,
-        shalloc_space->priv_heap->base.size, PROT_READ);
+    shalloc_buff_t *data = shalloc_heap_to_buff(shalloc_space->priv_heap);
+    int ret = mprotect(data->start, data->size, PROT_READ);
     assert(ret == 0);
 }
 
@@ -0,0 +1,125 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Shared memory backing for inherit heaps. Segments are memfds (or
+ * unlinked POSIX shm objects where memfd_create() is missing), so they
+ * are sized with ftruncate(), populated lazily and released as soon as
+ * the last fd and mapping go away. Memfds can be sealed read-only. The
+ * fds are not close-on-exec, which lets children find them at the same
+ * number after exec. Segments of named spaces are named POSIX shm objects
+ * instead, which stay around until shalloc_space_unlink().
+ */
+#define SHALLOC_SHM_NAME            "shalloc"
+
+/* Shared memory utility functions. */
+int shalloc_shm_create(size_t size, int mmap_flags)
+{
+    int fd;
+#ifdef MFD_HUGETLB
+    unsigned flags = MFD_ALLOW_SEALING;
+
+    if (mmap_flags & MAP_HUGETLB) {
+        flags |= MFD_HUGETLB;
+    }
+    fd = memfd_create(SHALLOC_SHM_NAME, flags);
+#else
+    char name[64];
+
+    sprintf(name, "/%s.%d.%p", SHALLOC_SHM_NAME, (int) getpid(),
+        (void*) &size);
+    fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#endif
+    if (fd < 0) {
+        return -1;
+    }
+    if (shalloc_shm_resize(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shalloc_shm_resize(int fd, size_t size)
+{
+    return ftruncate(fd, size);
+}
+
+size_t shalloc_shm_get_size(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+int shalloc_shm_map(int fd, void *addr, size_t size, size_t offset,
+    int prot)
+{
+    void *real_addr = mmap(addr, size, prot, MAP_SHARED|MAP_FIXED, fd,
+        offset);
+    return real_addr == addr ? 0 : -1;
+}
+
+int shalloc_shm_seal(int fd)
+{
+    /*
+     * Unlike F_SEAL_WRITE, F_SEAL_FUTURE_WRITE does not require all
+     * writable mappings to be gone first, it only denies new ones.
+     */
+    return fcntl(fd, F_ADD_SEALS,
+        F_SEAL_FUTURE_WRITE|F_SEAL_GROW|F_SEAL_SHRINK|F_SEAL_SEAL);
+}
+
+void shalloc_shm_close(int fd)
+{
+    close(fd);
+}
+
+static void shalloc_shm_name(char *buff, size_t buff_size, const char *name,
+    int slot)
+{
+    if (slot < 0) {
+        snprintf(buff, buff_size, "/%s.%s", SHALLOC_SHM_NAME, name);
+    }
+    else {
+        snprintf(buff, buff_size, "/%s.%s.%d", SHALLOC_SHM_NAME, name, slot);
+    }
+}
+
+int shalloc_shm_open_named(const char *name, int slot, int flags,
+    size_t size)
+{
+    char buff[SHALLOC_SPACE_NAME_MAX + 32];
+    int fd;
+
+    /* Slot -1 is the control segment, the others are inherit heaps. */
+    shalloc_shm_name(buff, sizeof(buff), name, slot);
+    fd = shm_open(buff, O_RDWR|flags, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((flags & O_CREAT) && shalloc_shm_resize(fd, size) < 0) {
+        close(fd);
+        shm_unlink(buff);
+        return -1;
+    }
+    return fd;
+}
+
+void shalloc_shm_unlink_named(const char *name, int slot)
+{
+    char buff[SHALLOC_SPACE_NAME_MAX + 32];
+
+    shalloc_shm_name(buff, sizeof(buff), name, slot);
+    shm_unlink(buff);
+}
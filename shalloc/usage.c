@@ -0,0 +1,101 @@
+#include <shalloc/shalloc.h>
+#include "include/util.h"
+#include "include/pagemap.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Physical memory usage of address ranges, from PAGEMAP_SCAN, which
+ * returns runs of pages in the same state. Without it (before Linux 6.7)
+ * only residency is known, from mincore(), and all resident pages of
+ * non-file ranges count as dirty.
+ */
+#define SHALLOC_USAGE_SCAN_RANGES   64
+#define SHALLOC_USAGE_MINCORE_PAGES 512
+
+/* Usage utility functions. */
+static int shalloc_usage_mincore(char *start, char *end, int file,
+    shalloc_usage_t *usage)
+{
+    unsigned char vec[SHALLOC_USAGE_MINCORE_PAGES];
+    size_t i, num_pages;
+
+    while (start < end) {
+        num_pages = (end - start)/SHALLOC_PAGE_SIZE;
+        if (num_pages > SHALLOC_USAGE_MINCORE_PAGES) {
+            num_pages = SHALLOC_USAGE_MINCORE_PAGES;
+        }
+        if (mincore(start, num_pages*SHALLOC_PAGE_SIZE, vec) < 0) {
+            return -1;
+        }
+        for (i = 0; i < num_pages; i++) {
+            if (vec[i] & 1) {
+                usage->resident_pages++;
+                usage->dirty_pages += !file;
+            }
+        }
+        start += num_pages*SHALLOC_PAGE_SIZE;
+    }
+    return 0;
+}
+
+/* Usage interface. */
+int shalloc_usage_add(void *addr, size_t size, int file,
+    shalloc_usage_t *usage)
+{
+    struct page_region regions[SHALLOC_USAGE_SCAN_RANGES];
+    struct pm_scan_arg arg;
+    char *start, *end;
+    size_t num_pages;
+    long ret, i;
+    int fd;
+
+    start = (char*) ((uintptr_t) addr & ~(SHALLOC_PAGE_SIZE - 1));
+    end = (char*) (((uintptr_t) addr + size + SHALLOC_PAGE_SIZE - 1)
+        & ~(SHALLOC_PAGE_SIZE - 1));
+    usage->size += size;
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+    arg.start = (uintptr_t) start;
+    arg.end = (uintptr_t) end;
+    arg.vec = (uintptr_t) regions;
+    arg.vec_len = SHALLOC_USAGE_SCAN_RANGES;
+    arg.category_anyof_mask = PAGE_IS_PRESENT|PAGE_IS_SWAPPED;
+    arg.return_mask = PAGE_IS_PRESENT|PAGE_IS_SWAPPED|PAGE_IS_FILE
+        |PAGE_IS_PFNZERO;
+    fd = open(SHALLOC_PAGEMAP_PATH, O_RDONLY|O_CLOEXEC);
+    ret = fd < 0 ? -1 : ioctl(fd, PAGEMAP_SCAN, &arg);
+    if (ret < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return shalloc_usage_mincore(start, end, file, usage);
+    }
+
+    /* Pages mapping the zero page or a file take no memory of their own. */
+    while (1) {
+        for (i = 0; i < ret; i++) {
+            num_pages = (regions[i].end - regions[i].start)/SHALLOC_PAGE_SIZE;
+            if (regions[i].categories & PAGE_IS_SWAPPED) {
+                usage->swapped_pages += num_pages;
+                continue;
+            }
+            usage->resident_pages += num_pages;
+            if (!(regions[i].categories & PAGE_IS_PFNZERO)
+                && !(file && (regions[i].categories & PAGE_IS_FILE))) {
+                usage->dirty_pages += num_pages;
+            }
+        }
+        if (arg.walk_end >= arg.end) {
+            break;
+        }
+        arg.start = arg.walk_end;
+        ret = ioctl(fd, PAGEMAP_SCAN, &arg);
+        if (ret < 0) {
+            break;
+        }
+    }
+    close(fd);
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,102 @@
+#include <shalloc/shalloc.h>
+#include <limits.h>
+#include <unistd.h>
+
+/*
+ * Checkpoints of spaces with file heaps. The checkpoint only records where
+ * the heap file lives, so a restored process sees the file as it is at
+ * restore time, next to the other heaps as they were at checkpoint time.
+ */
+typedef struct {
+    shalloc_heap_t *file_heap;
+    char *file_str;
+    char *heap_str;
+} ckpt_root_t;
+
+static int ckpt_fail(const char *msg)
+{
+    printf("ckpt_file_heap: %s\n", msg);
+    return 1;
+}
+
+static int ckpt_create(char *argv0, const char *dir)
+{
+    char path[PATH_MAX];
+    shalloc_heap_t *heap;
+    ckpt_root_t *root;
+
+    shalloc_space_init();
+    snprintf(path, sizeof(path), "%s/heap", dir);
+    heap = shalloc_heap_create(1 << 20, SHALLOC_DEFAULT_MMAP_FLAGS, 0);
+    root = heap ? shalloc_malloc(shalloc_heap_to_region(heap),
+        sizeof(*root)) : NULL;
+    if (!root) {
+        return ckpt_fail("heap creation failed");
+    }
+    root->file_heap = shalloc_heap_create_file(path, 1 << 20,
+        SHALLOC_DEFAULT_MMAP_FLAGS, 0);
+    if (!root->file_heap) {
+        return ckpt_fail("file heap creation failed");
+    }
+    root->file_str = shalloc_malloc(shalloc_heap_to_region(root->file_heap),
+        16);
+    root->heap_str = shalloc_malloc(shalloc_heap_to_region(heap), 16);
+    strcpy(root->file_str, "file");
+    strcpy(root->heap_str, "heap");
+    *(ckpt_root_t**) SHALLOC_INHERIT_DATA = root;
+
+    snprintf(path, sizeof(path), "%s/ckpt", dir);
+    if (shalloc_space_checkpoint(path) < 0) {
+        return ckpt_fail("checkpoint failed");
+    }
+    strcpy(root->file_str, "file later");
+    strcpy(root->heap_str, "heap later");
+    if (shalloc_heap_sync(root->file_heap) < 0) {
+        return ckpt_fail("file heap sync failed");
+    }
+    execl(argv0, argv0, dir, NULL);
+    return ckpt_fail("exec failed");
+}
+
+static int ckpt_restore(const char *dir)
+{
+    char path[PATH_MAX];
+    ckpt_root_t *root;
+
+    snprintf(path, sizeof(path), "%s/ckpt", dir);
+    if (shalloc_space_restore(path) < 0) {
+        return ckpt_fail("restore failed");
+    }
+    root = *(ckpt_root_t**) SHALLOC_INHERIT_DATA;
+    if (strcmp(root->heap_str, "heap") != 0) {
+        return ckpt_fail("heap not restored");
+    }
+    if (strcmp(root->file_str, "file later") != 0) {
+        return ckpt_fail("file heap not reopened");
+    }
+    if (!shalloc_malloc(shalloc_heap_to_region(root->file_heap), 16)) {
+        return ckpt_fail("file heap allocation failed");
+    }
+    shalloc_space_close();
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/shalloc_ckpt_XXXXXX";
+    char cmd[64];
+    int ret;
+
+    if (argc == 1) {
+        if (!mkdtemp(dir)) {
+            return ckpt_fail("mkdtemp failed");
+        }
+        return ckpt_create(argv[0], dir);
+    }
+    ret = ckpt_restore(argv[1]);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", argv[1]);
+    if (system(cmd) != 0) {
+        ret = 1;
+    }
+    return ret;
+}
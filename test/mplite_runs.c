@@ -0,0 +1,44 @@
+#include <mplite/mplite.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Empty runs must not pin the pool. A single small allocation leaves a run
+ * behind once freed, which has to make way for a block of half the pool
+ * and must not count as checked out in the meantime.
+ */
+#define RUNS_POOL_SIZE              (64 << 20)
+#define RUNS_SLOT_SIZE              16
+
+int main()
+{
+    mplite_t handle;
+    void *buf, *ptr;
+
+    buf = aligned_alloc(4096, RUNS_POOL_SIZE);
+    if (!buf || mplite_init(&handle, buf, RUNS_POOL_SIZE, 64, NULL)
+        != MPLITE_OK || mplite_init_runs(&handle, RUNS_SLOT_SIZE)
+        != MPLITE_OK) {
+        printf("mplite_runs: init failed\n");
+        return 1;
+    }
+    ptr = mplite_malloc(&handle, RUNS_SLOT_SIZE);
+    if (!ptr) {
+        printf("mplite_runs: small allocation failed\n");
+        return 1;
+    }
+    mplite_free(&handle, ptr);
+    if (handle.currentOut != 0 || handle.currentCount != 0) {
+        printf("mplite_runs: empty run still checked out (%llu bytes)\n",
+            (unsigned long long) handle.currentOut);
+        return 1;
+    }
+    ptr = mplite_malloc(&handle, RUNS_POOL_SIZE/2);
+    if (!ptr) {
+        printf("mplite_runs: empty run blocks large allocation\n");
+        return 1;
+    }
+    mplite_free(&handle, ptr);
+    free(buf);
+    return 0;
+}
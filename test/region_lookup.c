@@ -0,0 +1,96 @@
+#include <shalloc/shalloc.h>
+
+/*
+ * Pointer lookups in small regions. Region buffers are not page aligned,
+ * so neighbouring regions and their sub-regions share pages, and lookups
+ * must still find the innermost region of every pointer.
+ */
+#define LOOKUP_NUM_REGIONS          64
+#define LOOKUP_BUFF_SIZE            1536
+
+static shalloc_region_t *lookup_regions[LOOKUP_NUM_REGIONS];
+static shalloc_region_t *lookup_subregions[LOOKUP_NUM_REGIONS];
+static void *lookup_ptrs[LOOKUP_NUM_REGIONS];
+static void *lookup_subptrs[LOOKUP_NUM_REGIONS];
+
+static int lookup_fail(const char *msg, int i)
+{
+    printf("region_lookup: %s (region %d)\n", msg, i);
+    return 1;
+}
+
+static int lookup_check(shalloc_heap_t *heap, int i)
+{
+    if (shalloc_ptr_to_region(lookup_ptrs[i]) != lookup_regions[i]) {
+        return lookup_fail("wrong region", i);
+    }
+    if (shalloc_ptr_to_region(lookup_subptrs[i]) != lookup_subregions[i]) {
+        return lookup_fail("wrong sub-region", i);
+    }
+    if (shalloc_ptr_to_region(lookup_regions[i])
+        != shalloc_heap_to_region(heap)) {
+        return lookup_fail("wrong region of region object", i);
+    }
+    if (shalloc_ptr_to_heap(lookup_subptrs[i]) != heap) {
+        return lookup_fail("wrong heap", i);
+    }
+    return 0;
+}
+
+int main()
+{
+    shalloc_heap_t *heap;
+    shalloc_region_t *region;
+    int i;
+
+    shalloc_space_init();
+    heap = shalloc_heap_create(1 << 24, SHALLOC_DEFAULT_MMAP_FLAGS, 0);
+    if (!heap) {
+        return lookup_fail("heap creation failed", -1);
+    }
+    region = shalloc_heap_to_region(heap);
+    for (i = 0; i < LOOKUP_NUM_REGIONS; i++) {
+        lookup_regions[i] = shalloc_region_create(region, LOOKUP_BUFF_SIZE,
+            LOOKUP_BUFF_SIZE, 0, 0, 0);
+        lookup_ptrs[i] = lookup_regions[i] ?
+            shalloc_malloc(lookup_regions[i], 32) : NULL;
+        lookup_subregions[i] = lookup_ptrs[i] ?
+            shalloc_region_create(lookup_regions[i], LOOKUP_BUFF_SIZE/2,
+            LOOKUP_BUFF_SIZE/2, 0, 0, SHALLOC_BUFF_ALLOC_TYPE_NOFREE) : NULL;
+        lookup_subptrs[i] = lookup_subregions[i] ?
+            shalloc_malloc(lookup_subregions[i], 16) : NULL;
+        if (!lookup_subptrs[i]) {
+            return lookup_fail("region creation failed", i);
+        }
+        if (lookup_regions[i]->data_head->size > LOOKUP_BUFF_SIZE) {
+            return lookup_fail("buffer size rounded up", i);
+        }
+    }
+    for (i = 0; i < LOOKUP_NUM_REGIONS; i++) {
+        if (lookup_check(heap, i)) {
+            return 1;
+        }
+    }
+
+    /* Pages shared with destroyed regions go back to the others. */
+    for (i = 0; i < LOOKUP_NUM_REGIONS; i += 2) {
+        shalloc_free_any(lookup_ptrs[i]);
+        shalloc_region_destroy(lookup_subregions[i]);
+        shalloc_region_destroy(lookup_regions[i]);
+    }
+    for (i = 1; i < LOOKUP_NUM_REGIONS; i += 2) {
+        if (lookup_check(heap, i)) {
+            return 1;
+        }
+        shalloc_region_destroy(lookup_subregions[i]);
+        shalloc_region_destroy(lookup_regions[i]);
+    }
+    for (i = 0; i < LOOKUP_NUM_REGIONS; i++) {
+        if (shalloc_ptr_to_region(lookup_subptrs[i]) != region) {
+            return lookup_fail("destroyed region still mapped", i);
+        }
+    }
+    shalloc_region_destroy(region);
+    shalloc_space_close();
+    return 0;
+}
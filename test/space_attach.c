@@ -0,0 +1,149 @@
+#include <shalloc/shalloc.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Two processes attached to the same named space create heaps at the same
+ * time. Their inherit heaps must get distinct table slots and address
+ * ranges, clear of the private heaps of either process, and each process
+ * must find the heaps of the other by pointer.
+ */
+#define ATTACH_HEAPS                48
+#define ATTACH_PRIV_EVERY           4
+#define ATTACH_HEAP_SIZE            (64 << 10)
+
+typedef struct {
+    volatile int attached;
+    volatile int go;
+    shalloc_heap_t *heaps[2][ATTACH_HEAPS];
+    char *strs[2][ATTACH_HEAPS];
+    shalloc_range_t privs[2][ATTACH_HEAPS/ATTACH_PRIV_EVERY];
+} attach_state_t;
+
+static int attach_fail(const char *msg)
+{
+    printf("space_attach: %s\n", msg);
+    return 1;
+}
+
+static int attach_overlap(shalloc_range_t *a, shalloc_range_t *b)
+{
+    return a->start < b->start + b->size && b->start < a->start + a->size;
+}
+
+static int attach_work(attach_state_t *state, int id)
+{
+    shalloc_heap_t *heap;
+    shalloc_range_t *priv;
+    int k;
+
+    while (!state->go);
+    for (k = 0; k < ATTACH_HEAPS; k++) {
+        heap = shalloc_heap_create(ATTACH_HEAP_SIZE, SHALLOC_MAP_INHERIT, 0);
+        if (!heap) {
+            return attach_fail("inherit heap creation failed");
+        }
+        state->strs[id][k] = shalloc_malloc(shalloc_heap_to_region(heap), 16);
+        if (!state->strs[id][k]) {
+            return attach_fail("allocation failed");
+        }
+        sprintf(state->strs[id][k], "%d:%d", id, k);
+        state->heaps[id][k] = heap;
+        if (k % ATTACH_PRIV_EVERY) {
+            continue;
+        }
+        heap = shalloc_heap_create(ATTACH_HEAP_SIZE,
+            SHALLOC_DEFAULT_MMAP_FLAGS, 0);
+        if (!heap) {
+            return attach_fail("private heap creation failed");
+        }
+        priv = &state->privs[id][k/ATTACH_PRIV_EVERY];
+        priv->start = heap->base.start;
+        priv->size = heap->base.size;
+    }
+    return 0;
+}
+
+static int attach_check(attach_state_t *state)
+{
+    shalloc_range_t ranges[2*ATTACH_HEAPS];
+    char str[16];
+    int i, j, k;
+
+    for (i = 0; i < 2*ATTACH_HEAPS; i++) {
+        ranges[i].start = state->heaps[i/ATTACH_HEAPS][i%ATTACH_HEAPS]
+            ->base.start;
+        ranges[i].size = state->heaps[i/ATTACH_HEAPS][i%ATTACH_HEAPS]
+            ->base.size;
+        for (j = 0; j < i; j++) {
+            if (state->heaps[j/ATTACH_HEAPS][j%ATTACH_HEAPS]
+                == state->heaps[i/ATTACH_HEAPS][i%ATTACH_HEAPS]) {
+                return attach_fail("table slot claimed twice");
+            }
+            if (attach_overlap(&ranges[i], &ranges[j])) {
+                return attach_fail("inherit heaps overlap");
+            }
+        }
+        for (k = 0; k < 2*ATTACH_HEAPS/ATTACH_PRIV_EVERY; k++) {
+            if (attach_overlap(&ranges[i],
+                &state->privs[k/(ATTACH_HEAPS/ATTACH_PRIV_EVERY)]
+                [k%(ATTACH_HEAPS/ATTACH_PRIV_EVERY)])) {
+                return attach_fail("inherit heap overlaps a private heap");
+            }
+        }
+    }
+
+    /* Heaps of the peer are mapped as they are looked up. */
+    for (k = 0; k < ATTACH_HEAPS; k++) {
+        if (shalloc_ptr_to_heap(state->strs[1][k]) != state->heaps[1][k]) {
+            return attach_fail("peer heap not found");
+        }
+        sprintf(str, "1:%d", k);
+        if (strcmp(state->strs[1][k], str) != 0) {
+            return attach_fail("peer heap contents differ");
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    attach_state_t *state;
+    char name[32];
+    pid_t pid;
+    int status, ret;
+
+    if (argc > 1) {
+        if (shalloc_space_attach(argv[1]) < 0) {
+            return attach_fail("attach failed");
+        }
+        state = (attach_state_t*) SHALLOC_INHERIT_DATA;
+        state->attached = 1;
+        return attach_work(state, 1);
+    }
+
+    snprintf(name, sizeof(name), "attach.%d", (int) getpid());
+    shalloc_space_init();
+    if (shalloc_space_publish(name) < 0) {
+        return attach_fail("publish failed");
+    }
+    state = (attach_state_t*) SHALLOC_INHERIT_DATA;
+    memset(state, 0, sizeof(*state));
+    pid = fork();
+    if (pid == 0) {
+        execl(argv[0], argv[0], name, NULL);
+        _exit(attach_fail("exec failed"));
+    }
+    while (pid > 0 && !state->attached && waitpid(pid, &status, WNOHANG) == 0);
+    state->go = 1;
+    ret = attach_work(state, 0);
+    if (pid < 0 || waitpid(pid, &status, 0) != pid
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ret = attach_fail("peer failed");
+    }
+    if (ret == 0) {
+        ret = attach_check(state);
+    }
+    shalloc_space_unlink(name);
+    return ret;
+}